@@ -22,19 +22,38 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "bsaexception.h"
 #include "bsafile.h"
 #include "bsafolder.h"
+#include "bsabufferpool.h"
+#include "bsainflater.h"
+#include "bsaioring.h"
+#include "bsapositionalfile.h"
+#include "bsamappedoutput.h"
+#include "bsaoutputfile.h"
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <algorithm>
+#include <atomic>
 #include <queue>
+#include <set>
+#include <functional>
 #include <memory>
 #include <boost/shared_array.hpp>
 #include <boost/thread.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/interprocess/sync/interprocess_semaphore.hpp>
-#include <zlib.h>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/core/null_deleter.hpp>
 #include <sys/stat.h>
+
+#ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#else // WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif // WIN32
 
 using std::fstream;
 
@@ -42,8 +61,39 @@ using namespace boost::posix_time;
 
 namespace BSA {
 
+// identifies index cache files and their format
+static const char INDEXCACHE_MAGIC[] = "BSAI";
+static const BSAULong INDEXCACHE_VERSION = 1;
+
+// maximum size of the unused buffers kept for reuse
+static const size_t BUFFERPOOL_SIZE = 64 * 1024 * 1024;
+
+// each thread decompressing files keeps its own zlib context
+static boost::thread_specific_ptr<Inflater> s_Inflater;
+
+static Inflater &threadInflater()
+{
+  Inflater *inflater = s_Inflater.get();
+  if (inflater == nullptr) {
+    inflater = new Inflater;
+    s_Inflater.reset(inflater);
+  }
+  return *inflater;
+}
+
+static const size_t DEFAULT_EXTRACT_MEMORY_BUDGET = 128 * 1024 * 1024;
+
+
 Archive::Archive()
-  : m_RootFolder(new Folder),
+  : m_DataFile(new PositionalFile),
+    m_MappedData(nullptr), m_MappedSize(0),
+    m_BufferPool(new BufferPool(BUFFERPOOL_SIZE)),
+    m_VerifyThreadCount(0),
+    m_ExtractThreadCount(0),
+    m_ExtractMemoryBudget(DEFAULT_EXTRACT_MEMORY_BUDGET),
+    m_ExtractIoRing(false),
+    m_ExtractMappedOutput(false),
+    m_RootFolder(new Folder),
     m_ArchiveFlags(FLAG_HASDIRNAMES | FLAG_HASFILENAMES),
     m_Type(TYPE_SKYRIM)
 {
@@ -52,9 +102,7 @@ Archive::Archive()
 
 Archive::~Archive()
 {
-  if (m_File.is_open()) {
-    m_File.close();
-  }
+  close();
 }
 
 
@@ -78,73 +126,419 @@ BSAULong Archive::typeToID(EType type)
 }
 
 
-Archive::Header Archive::readHeader(std::fstream &infile)
+Archive::Header Archive::readHeader(const char *&data, const char *end)
 {
   Header result;
 
-  char fileID[4];
-  infile.read(fileID, 4);
-  if (memcmp(fileID, "BSA\0", 4) != 0) {
+  if ((end - data < 4) || (memcmp(data, "BSA\0", 4) != 0)) {
     throw data_invalid_exception(makeString("not a bsa file"));
   }
+  data += 4;
 
-  result.type  = typeFromID(readType<BSAULong>(infile));
-  result.offset           = readType<BSAULong>(infile);
-  result.archiveFlags     = readType<BSAULong>(infile);
-  result.folderCount      = readType<BSAULong>(infile);
-  result.fileCount        = readType<BSAULong>(infile);
-  result.folderNameLength = readType<BSAULong>(infile);
-  result.fileNameLength   = readType<BSAULong>(infile);
-  result.fileFlags        = readType<BSAULong>(infile);
+  result.type  = typeFromID(readType<BSAULong>(data, end));
+  result.offset           = readType<BSAULong>(data, end);
+  result.archiveFlags     = readType<BSAULong>(data, end);
+  result.folderCount      = readType<BSAULong>(data, end);
+  result.fileCount        = readType<BSAULong>(data, end);
+  result.folderNameLength = readType<BSAULong>(data, end);
+  result.fileNameLength   = readType<BSAULong>(data, end);
+  result.fileFlags        = readType<BSAULong>(data, end);
 
   return result;
 }
 
 
-EErrorCode Archive::read(const char* fileName, bool testHashes)
+EErrorCode Archive::read(const char* fileName, bool testHashes, bool memoryMapped,
+                         bool lazyFileNames)
 {
-  m_File.open(fileName, fstream::in | fstream::binary);
-  if (!m_File.is_open()) {
-    return ERROR_FILENOTFOUND;
+  // names are required to test the hashes
+  bool readNames = testHashes || !lazyFileNames;
+
+  m_IndexCacheKey.fileName.clear();
+  m_HashMismatches.clear();
+
+  // the whole directory (header, folder records, file records and names) is
+  // parsed from memory. It's either read straight from the mapped view or
+  // loaded into this buffer with a single read
+  std::vector<char> directory;
+
+  if (memoryMapped) {
+    using namespace boost::interprocess;
+    try {
+      m_Mapping.reset(new file_mapping(fileName, read_only));
+      m_MappedRegion.reset(new mapped_region(*m_Mapping, read_only));
+    } catch (const interprocess_exception&) {
+      close();
+      return ERROR_FILENOTFOUND;
+    }
+    m_MappedData = static_cast<const char*>(m_MappedRegion->get_address());
+    m_MappedSize = m_MappedRegion->get_size();
+  } else {
+    m_File.open(fileName, fstream::in | fstream::binary);
+    if (!m_File.is_open() || !m_DataFile->open(fileName)) {
+      close();
+      return ERROR_FILENOTFOUND;
+    }
+    m_File.exceptions(std::ios_base::badbit);
+    try {
+      directory.resize(HEADER_SIZE);
+      m_File.read(&directory[0], HEADER_SIZE);
+      directory.resize(static_cast<size_t>(m_File.gcount()));
+    } catch (std::ios_base::failure&) {
+      return ERROR_INVALIDDATA;
+    }
   }
-  m_File.exceptions(std::ios_base::badbit);
+
+  const char *begin = mapped() ? m_MappedData : directory.data();
+  const char *end = mapped() ? m_MappedData + m_MappedSize
+                             : directory.data() + directory.size();
+  const char *pos = begin;
+
+  Header header;
   try {
-    Header header;
+    header = readHeader(pos, end);
+  } catch (const data_invalid_exception &e) {
+    throw data_invalid_exception(makeString("%s (filename: %s)", e.what(), fileName));
+  }
+
+  m_Type = header.type;
+  m_ArchiveFlags = header.archiveFlags;
+
+  // the folder tree is only built from the index when requested
+  m_RootFolder.reset();
+  m_FolderViews.clear();
+  m_FileViews.clear();
+
+  if (!m_IndexCacheDirectory.empty()) {
+    struct stat fileStat;
+    if (stat(fileName, &fileStat) == 0) {
+      m_IndexCacheKey.fileName = fileName;
+      m_IndexCacheKey.fileSize = static_cast<unsigned long long>(fileStat.st_size);
+      m_IndexCacheKey.modifiedTime = static_cast<unsigned long long>(fileStat.st_mtime);
+      memcpy(m_IndexCacheKey.header, begin, sizeof(m_IndexCacheKey.header));
+      if (loadIndexCache(testHashes)) {
+        return ERROR_NONE;
+      }
+    }
+  }
+
+  if (!mapped()) {
     try {
-      header = readHeader(m_File);
-    } catch (const data_invalid_exception &e) {
-      throw data_invalid_exception(makeString("%s (filename: %s)", e.what(), fileName));
+      EErrorCode result = readDirectory(header, directory, readNames);
+      if (result != ERROR_NONE) {
+        return result;
+      }
+    } catch (std::ios_base::failure&) {
+      return ERROR_INVALIDDATA;
     }
+    begin = directory.data();
+    end = directory.data() + directory.size();
+    pos = begin + HEADER_SIZE;
+  }
 
-    m_Type = header.type;
-    m_ArchiveFlags = header.archiveFlags;
+  m_Index.read(begin, end, pos, header.folderCount, header.fileNameLength);
 
-    // flat list of folders as they were stored in the archive
-    std::vector<Folder::Ptr> folders;
+  if (!readNames) {
+    // resolved on first use
+    return ERROR_NONE;
+  }
 
-    for (unsigned long i = 0; i < header.folderCount; ++i) {
-      folders.push_back(m_RootFolder->addFolder(m_File, header.fileNameLength, header.offset));
-    }
+  const char *fileNames = begin + (std::min)(static_cast<size_t>(m_Index.fileNamesOffset()),
+                                             static_cast<size_t>(end - begin));
+  bool namesValid = m_Index.readFileNames(fileNames, end);
+  if (testHashes) {
+    verifyHashes();
+  }
+  if (!namesValid || !m_HashMismatches.empty()) {
+    return ERROR_INVALIDHASHES;
+  }
+  saveIndexCache(testHashes);
+  return ERROR_NONE;
+}
 
-    m_File.seekg(header.offset);
 
-    bool hashesValid = true;
-    for (std::vector<Folder::Ptr>::iterator iter = folders.begin();
-         iter != folders.end(); ++iter) {
-      if (!(*iter)->resolveFileNames(m_File, testHashes)) {
-        hashesValid = false;
-      }
+EErrorCode Archive::readDirectory(const Header &header, std::vector<char> &directory,
+                                  bool includeFileNames)
+{
+  size_t offset = directory.size();
+  m_File.clear();
+  m_File.seekg(0, fstream::end);
+  unsigned long long fileSize = static_cast<unsigned long long>(m_File.tellg());
+  m_File.seekg(offset, fstream::beg);
+
+  // the header is untrusted, don't allocate for records that can't be there
+  unsigned long long recordsSize = header.offset
+      + header.folderCount * static_cast<unsigned long long>(FOLDER_RECORD_SIZE)
+      + header.fileCount * static_cast<unsigned long long>(FILE_RECORD_SIZE);
+  if (recordsSize > fileSize) {
+    return ERROR_INVALIDDATA;
+  }
+
+  // folder records, folder name blocks with their file records and the
+  // file name list. The name lengths in the header are supposed to include
+  // the terminating zeros but not all tools write them that way (including
+  // our own write), so there is room for one extra byte per name
+  size_t size = static_cast<size_t>(header.offset)
+              + header.folderCount * static_cast<size_t>(FOLDER_RECORD_SIZE + 2)
+              + header.folderNameLength
+              + header.fileCount * static_cast<size_t>(FILE_RECORD_SIZE);
+  if (includeFileNames) {
+    size += header.fileCount + header.fileNameLength;
+  }
+  // the slack may reach past the end of very small archives
+  size = static_cast<size_t>((std::min)(static_cast<unsigned long long>(size), fileSize));
+
+  if (size > offset) {
+    directory.resize(size);
+    m_File.read(&directory[offset], size - offset);
+    directory.resize(offset + static_cast<size_t>(m_File.gcount()));
+  }
+  return ERROR_NONE;
+}
+
+
+EErrorCode Archive::resolveFileNames()
+{
+  if (m_Index.fileNamesRead()) {
+    return ERROR_NONE;
+  }
+
+  bool namesValid = false;
+  if (mapped()) {
+    size_t offset = (std::min)(static_cast<size_t>(m_Index.fileNamesOffset()), m_MappedSize);
+    namesValid = m_Index.readFileNames(m_MappedData + offset,
+                                       m_MappedData + m_MappedSize);
+  } else {
+    // names and their terminators, again with room for tools that don't
+    // include the terminators in the length
+    std::vector<char> fileNames(static_cast<size_t>(m_Index.fileNamesLength())
+                                + m_Index.numFiles());
+    try {
+      m_File.clear();
+      m_File.seekg(m_Index.fileNamesOffset(), fstream::beg);
+      m_File.read(fileNames.data(), fileNames.size());
+      fileNames.resize(static_cast<size_t>(m_File.gcount()));
+    } catch (std::ios_base::failure&) {
+      fileNames.clear();
     }
-    return hashesValid ? ERROR_NONE : ERROR_INVALIDHASHES;
-  } catch (std::ios_base::failure&) {
+    namesValid = m_Index.readFileNames(fileNames.data(),
+                                       fileNames.data() + fileNames.size());
+  }
+  if (!namesValid) {
     return ERROR_INVALIDDATA;
   }
+  saveIndexCache(false);
+  return ERROR_NONE;
+}
+
+
+const std::vector<BSAULong> &Archive::verifyHashes()
+{
+  resolveFileNames();
+  m_HashMismatches = m_Index.verifyHashes(m_VerifyThreadCount != 0
+                                          ? m_VerifyThreadCount
+                                          : boost::thread::hardware_concurrency());
+  return m_HashMismatches;
+}
+
+
+std::string Archive::indexCacheFile() const
+{
+  return makeString("%s/%llx.idx", m_IndexCacheDirectory.c_str(),
+                    static_cast<unsigned long long>(
+                      std::hash<std::string>()(m_IndexCacheKey.fileName)));
+}
+
+
+bool Archive::loadIndexCache(bool hashesTested)
+{
+  using namespace boost::interprocess;
+
+  std::unique_ptr<file_mapping> cacheMapping;
+  std::unique_ptr<mapped_region> cacheRegion;
+  try {
+    cacheMapping.reset(new file_mapping(indexCacheFile().c_str(), read_only));
+    cacheRegion.reset(new mapped_region(*cacheMapping, read_only));
+  } catch (const interprocess_exception&) {
+    return false;
+  }
+
+  const char *data = static_cast<const char*>(cacheRegion->get_address());
+  const char *end = data + cacheRegion->get_size();
+  try {
+    if ((end - data < 4) || (memcmp(data, INDEXCACHE_MAGIC, 4) != 0)) {
+      return false;
+    }
+    data += 4;
+    if ((readType<BSAULong>(data, end) != INDEXCACHE_VERSION)
+        || ((readType<unsigned char>(data, end) == 0) && hashesTested)
+        || (readType<unsigned long long>(data, end) != m_IndexCacheKey.fileSize)
+        || (readType<unsigned long long>(data, end) != m_IndexCacheKey.modifiedTime)) {
+      return false;
+    }
+    BSAULong nameLength = readType<BSAULong>(data, end);
+    if ((nameLength != m_IndexCacheKey.fileName.length())
+        || (static_cast<size_t>(end - data) < nameLength)
+        || (m_IndexCacheKey.fileName.compare(0, nameLength, data, nameLength) != 0)) {
+      return false;
+    }
+    data += nameLength;
+    if ((static_cast<size_t>(end - data) < sizeof(m_IndexCacheKey.header))
+        || (memcmp(data, m_IndexCacheKey.header, sizeof(m_IndexCacheKey.header)) != 0)) {
+      return false;
+    }
+    data += sizeof(m_IndexCacheKey.header);
+  } catch (const data_invalid_exception&) {
+    return false;
+  }
+
+  if (!m_Index.load(data, end) || (data != end)) {
+    m_Index.clear();
+    return false;
+  }
+  return true;
+}
+
+
+void Archive::saveIndexCache(bool hashesTested) const
+{
+  if (m_IndexCacheKey.fileName.empty()) {
+    return;
+  }
+
+  // other processes may have the current cache file mapped, so the new one is
+  // written under a temporary name and then moved over it
+  std::string cacheFile = indexCacheFile();
+#ifdef WIN32
+  unsigned long processID = GetCurrentProcessId();
+#else
+  unsigned long processID = static_cast<unsigned long>(getpid());
+#endif
+  std::string tempFile = makeString("%s.%lx.%p.tmp", cacheFile.c_str(), processID,
+                                    static_cast<const void*>(this));
+
+  fstream file(tempFile.c_str(), fstream::out | fstream::binary | fstream::trunc);
+  if (!file.is_open()) {
+    return;
+  }
+  file.write(INDEXCACHE_MAGIC, 4);
+  writeType<BSAULong>(file, INDEXCACHE_VERSION);
+  writeType<unsigned char>(file, hashesTested ? 1 : 0);
+  writeType<unsigned long long>(file, m_IndexCacheKey.fileSize);
+  writeType<unsigned long long>(file, m_IndexCacheKey.modifiedTime);
+  writeType<BSAULong>(file, static_cast<BSAULong>(m_IndexCacheKey.fileName.length()));
+  file.write(m_IndexCacheKey.fileName.data(), m_IndexCacheKey.fileName.length());
+  file.write(m_IndexCacheKey.header, sizeof(m_IndexCacheKey.header));
+  m_Index.save(file);
+  file.close();
+
+  bool moved = !file.fail();
+  if (moved) {
+#ifdef WIN32
+    moved = MoveFileExA(tempFile.c_str(), cacheFile.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    moved = rename(tempFile.c_str(), cacheFile.c_str()) == 0;
+#endif
+  }
+  if (!moved) {
+    remove(tempFile.c_str());
+  }
 }
 
 
 void Archive::close()
 {
-  m_File.close();
+  if (m_File.is_open()) {
+    m_File.close();
+  }
+  m_DataFile->close();
+  m_MappedData = nullptr;
+  m_MappedSize = 0;
+  m_MappedRegion.reset();
+  m_Mapping.reset();
+}
+
+
+Folder::Ptr Archive::getRoot()
+{
+  if (m_RootFolder.get() == nullptr) {
+    resolveFileNames();
+    buildTree();
+  }
+  return m_RootFolder;
+}
+
+
+void Archive::buildTree()
+{
+  m_RootFolder.reset(new Folder);
+  m_FolderViews.clear();
+  m_FileViews.clear();
+  m_FolderViews.reserve(m_Index.numFolders());
+  m_FileViews.reserve(m_Index.numFiles());
+  for (BSAULong i = 0; i < m_Index.numFolders(); ++i) {
+    Folder::Ptr folder(new Folder);
+    folder->m_NameHash = m_Index.folderHash(i);
+    folder->m_Name = m_Index.folderName(i);
+    BSAULong lastFile = m_Index.firstFile(i) + m_Index.folderFileCount(i);
+    for (BSAULong file = m_Index.firstFile(i); file < lastFile; ++file) {
+      File::Ptr fileView(new File(folder.get(), m_Index.fileName(file),
+                                  m_Index.fileHash(file), m_Index.fileSize(file),
+                                  m_Index.fileOffset(file),
+                                  m_Index.fileCompressToggled(file), file));
+      folder->addFile(fileView);
+      m_FileViews.push_back(fileView);
+    }
+    m_RootFolder->addFolderInt(folder);
+    m_FolderViews.push_back(folder);
+  }
+}
+
+
+File::Ptr Archive::findFile(const std::string &path)
+{
+  BSAULong file = m_Index.findFile(path);
+  if (file == ArchiveIndex::NOT_FOUND) {
+    return File::Ptr();
+  }
+  getRoot();
+  return m_FileViews[file];
+}
+
+
+Folder::Ptr Archive::findFolder(const std::string &path)
+{
+  BSAULong folder = m_Index.findFolder(path);
+  if (folder == ArchiveIndex::NOT_FOUND) {
+    return Folder::Ptr();
+  }
+  getRoot();
+  return m_FolderViews[folder];
+}
+
+
+std::string Archive::filePath(BSAULong file) const
+{
+  return std::string(m_Index.folderName(m_Index.fileFolder(file)))
+      .append("\\").append(m_Index.fileName(file));
+}
+
+
+const char *Archive::mappedData(BSAULong offset, BSAULong &size) const
+{
+  if ((offset > m_MappedSize) || (size > m_MappedSize - offset)) {
+    return nullptr;
+  }
+  const char *data = m_MappedData + offset;
+  if (namePrefixed() && (size > 0)) {
+    BSAULong prefixLength = static_cast<unsigned char>(*data) + 1;
+    if (size < prefixLength) {
+      return nullptr;
+    }
+    data += prefixLength;
+    size -= prefixLength;
+  }
+  return data;
 }
 
 
@@ -268,7 +662,7 @@ EErrorCode Archive::write(const char *fileName)
   outfile.exceptions(std::ios_base::badbit);
 
   std::vector<Folder::Ptr> folders;
-  m_RootFolder->collectFolders(folders);
+  getRoot()->collectFolders(folders);
 
   std::vector<std::string> folderNames;
   std::vector<std::string> fileNames;
@@ -276,7 +670,7 @@ EErrorCode Archive::write(const char *fileName)
   BSAULong fileNamesLength = 0;
   for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
        folderIter != folders.end(); ++folderIter) {
-    std::string fullPath = (*folderIter)->getFullPath();
+    const std::string &fullPath = (*folderIter)->getFullPath();
     folderNames.push_back(fullPath);
     folderNamesLength += static_cast<BSAULong>(fullPath.length());
     for (std::vector<File::Ptr>::const_iterator fileIter = (*folderIter)->m_Files.begin();
@@ -314,7 +708,12 @@ EErrorCode Archive::write(const char *fileName)
     // write file data
     for (std::vector<Folder::Ptr>::iterator folderIter = folders.begin();
          folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeFileData(m_File, outfile);
+      EErrorCode error = (*folderIter)->writeFileData(m_File, m_MappedData,
+                                                      m_MappedSize, outfile);
+      if (error != ERROR_NONE) {
+        outfile.close();
+        return error;
+      }
     }
 
     outfile.seekp(0x24, fstream::beg);
@@ -342,305 +741,1266 @@ EErrorCode Archive::write(const char *fileName)
 
 static const unsigned long CHUNK_SIZE = 128 * 1024;
 
+// files up to this size are decompressed in one piece by the extraction
+// workers, larger ones in chunks
+static const BSAULong MAX_ONESHOT_INFLATE = 1024 * 1024;
 
 
-EErrorCode Archive::extractDirect(File::Ptr file, std::ofstream &outFile) const
+
+bool Archive::skipNamePrefix(BSAULong &offset, BSAULong &size) const
 {
-  EErrorCode result = ERROR_NONE;
+  if (!namePrefixed() || (size == 0)) {
+    return true;
+  }
+  unsigned char nameLength = 0;
+  if (m_DataFile->read(&nameLength, 1, offset) != 1) {
+    return false;
+  }
+  BSAULong prefixLength = static_cast<BSAULong>(nameLength) + 1;
+  if (size < prefixLength) {
+    return false;
+  }
+  offset += prefixLength;
+  size -= prefixLength;
+  return true;
+}
 
-  m_File.seekg(file->m_DataOffset, fstream::beg);
-  if (namePrefixed()) {
-    readBString(m_File);
+
+EErrorCode Archive::extractDirect(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const
+{
+  if (mapped()) {
+    const char *data = mappedData(dataOffset, size);
+    if (data == nullptr) {
+      return ERROR_INVALIDDATA;
+    }
+    return outFile.write(data, size) ? ERROR_NONE : ERROR_ACCESSFAILED;
   }
 
-  std::unique_ptr<char[]> inBuffer(new char[CHUNK_SIZE]);
+  if (!skipNamePrefix(dataOffset, size)) {
+    return ERROR_INVALIDDATA;
+  }
 
-  try {
-    unsigned long sizeLeft = file->m_FileSize;
+  boost::shared_array<unsigned char> inBuffer = m_BufferPool->get(CHUNK_SIZE);
 
-    while (sizeLeft > 0) {
-      int chunkSize = (std::min)(sizeLeft, CHUNK_SIZE);
-      m_File.read(inBuffer.get(), chunkSize);
-      outFile.write(inBuffer.get(), chunkSize);
-      sizeLeft -= chunkSize;
+  while (size > 0) {
+    BSAULong chunkSize = (std::min)(size, static_cast<BSAULong>(CHUNK_SIZE));
+    if (m_DataFile->read(inBuffer.get(), chunkSize, dataOffset) != chunkSize) {
+      return ERROR_INVALIDDATA;
     }
-  } catch (const std::exception&) {
-    result = ERROR_INVALIDDATA;
+    if (!outFile.write(inBuffer.get(), chunkSize)) {
+      return ERROR_ACCESSFAILED;
+    }
+    dataOffset += chunkSize;
+    size -= chunkSize;
   }
-  return result;
+  return ERROR_NONE;
 }
 
 
-boost::shared_array<unsigned char> Archive::decompress(unsigned char *inBuffer, BSAULong inSize,
-                                                       EErrorCode &result, BSAULong &outSize)
+EErrorCode Archive::inflateStream(const unsigned char *inBuffer, BSAULong inOffset,
+                                  BSAULong inSize, BSAULong outSize,
+                                  OutputFile *outFile, unsigned char *outBuffer) const
 {
-  memcpy(&outSize, inBuffer, sizeof(BSAULong));
-  inBuffer += sizeof(BSAULong);
-  inSize -= sizeof(BSAULong);
+  Inflater &inflater = threadInflater();
+  EErrorCode result = inflater.reset();
+  if (result != ERROR_NONE) {
+    return result;
+  }
 
-  if ((inSize == 0) || (outSize == 0)) {
-    return boost::shared_array<unsigned char>();
+  boost::shared_array<unsigned char> outChunk;
+  if (outFile != nullptr) {
+    outChunk = m_BufferPool->get(CHUNK_SIZE);
+  }
+  boost::shared_array<unsigned char> inChunk;
+  if (inBuffer != nullptr) {
+    inflater.setInput(inBuffer, inSize);
+    inSize = 0;
+  } else {
+    inChunk = m_BufferPool->get(CHUNK_SIZE);
   }
 
-  boost::shared_array<unsigned char> outBuffer(new unsigned char[outSize]);
+  BSAULong written = 0;
+  bool finished = false;
+  while ((written < outSize) && !finished) {
+    if (inflater.inputConsumed()) {
+      if (inSize == 0) {
+        // truncated stream
+        break;
+      }
+      BSAULong chunkSize = (std::min)(inSize, static_cast<BSAULong>(CHUNK_SIZE));
+      if (m_DataFile->read(inChunk.get(), chunkSize, inOffset) != chunkSize) {
+        return ERROR_INVALIDDATA;
+      }
+      inflater.setInput(inChunk.get(), chunkSize);
+      inOffset += chunkSize;
+      inSize -= chunkSize;
+    }
 
-  z_stream stream;
-  try {
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-    stream.avail_in = 0;
-    stream.next_in = Z_NULL;
-    int zlibRet = inflateInit(&stream);
-    if (zlibRet != Z_OK) {
-      result = ERROR_ZLIBINITFAILED;
-      return boost::shared_array<unsigned char>();
-    }
-
-    stream.avail_in = inSize;
-
-    stream.next_in = static_cast<Bytef*>(inBuffer);
-
-    do {
-      stream.avail_out = outSize;
-      stream.next_out = reinterpret_cast<Bytef*>(outBuffer.get());
-      zlibRet = inflate(&stream, Z_NO_FLUSH);
-      if ((zlibRet != Z_OK) && (zlibRet != Z_STREAM_END) && (zlibRet != Z_BUF_ERROR)) {
-#pragma message("pass result code to caller")
-        throw std::runtime_error("invalid data");
+    BSAULong produced = 0;
+    if (outFile != nullptr) {
+      result = inflater.inflateChunk(outChunk.get(),
+                                     (std::min)(outSize - written, static_cast<BSAULong>(CHUNK_SIZE)),
+                                     produced, finished);
+    } else {
+      result = inflater.inflateChunk(outBuffer + written, outSize - written, produced, finished);
+    }
+    if (result != ERROR_NONE) {
+      return result;
+    }
+    if ((outFile != nullptr) && !outFile->write(outChunk.get(), produced)) {
+      return ERROR_ACCESSFAILED;
+    }
+    written += produced;
+  }
+
+  if ((written < outSize) && (outFile == nullptr)) {
+    // pad to the stored size, as Inflater::inflate does
+    memset(outBuffer + written, 0, outSize - written);
+  } else if (written < outSize) {
+    memset(outChunk.get(), 0, CHUNK_SIZE);
+    while (written < outSize) {
+      BSAULong chunkSize = (std::min)(outSize - written, static_cast<BSAULong>(CHUNK_SIZE));
+      if (!outFile->write(outChunk.get(), chunkSize)) {
+        return ERROR_ACCESSFAILED;
       }
-    } while (stream.avail_out == 0);
-    inflateEnd(&stream);
-    return outBuffer;
-  } catch (const std::exception&) {
-    result = ERROR_INVALIDDATA;
-    inflateEnd(&stream);
-    return boost::shared_array<unsigned char>();
+      written += chunkSize;
+    }
   }
+  return ERROR_NONE;
 }
 
 
-EErrorCode Archive::extractCompressed(File::Ptr file, std::ofstream &outFile) const
+EErrorCode Archive::extractCompressed(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const
 {
-  EErrorCode result = ERROR_NONE;
-
-  if (file->m_FileSize == 0) {
+  const unsigned char *inBuffer = nullptr;
+  BSAULong outSize = 0UL;
+  if (size == 0) {
     // don't try to read empty file
-    return result;
+  } else if (mapped()) {
+    const char *data = mappedData(dataOffset, size);
+    if ((data == nullptr) || (size < sizeof(BSAULong))) {
+      return ERROR_INVALIDDATA;
+    }
+    memcpy(&outSize, data, sizeof(BSAULong));
+    inBuffer = reinterpret_cast<const unsigned char*>(data) + sizeof(BSAULong);
+    size -= sizeof(BSAULong);
+  } else {
+    // the file data has the original size prepended
+    if (!skipNamePrefix(dataOffset, size)
+        || (size < sizeof(BSAULong))
+        || (m_DataFile->read(&outSize, sizeof(BSAULong), dataOffset) != sizeof(BSAULong))) {
+      return ERROR_INVALIDDATA;
+    }
+    dataOffset += sizeof(BSAULong);
+    size -= sizeof(BSAULong);
   }
 
-  m_File.clear();
-  m_File.seekg(static_cast<std::ifstream::pos_type>(file->m_DataOffset), std::ios::beg);
-  if (namePrefixed()) {
-    readBString(m_File);
+  if (mapOutput(outSize)) {
+    MappedOutputFile mappedFile;
+    if (mappedFile.map(outFile, outSize)) {
+      EErrorCode result = inflateStream(inBuffer, dataOffset, size, outSize, nullptr, mappedFile.data());
+      if (!mappedFile.unmap() && (result == ERROR_NONE)) {
+        result = ERROR_ACCESSFAILED;
+      }
+      return result;
+    }
   }
 
-  BSAULong inSize = file->m_FileSize + sizeof(BSAULong); // file data has original size prepended
-  std::unique_ptr<unsigned char[]> inBuffer(new unsigned char[inSize]);
-  m_File.read(reinterpret_cast<char*>(inBuffer.get()), inSize);
-  BSAULong length = 0L;
-  boost::shared_array<unsigned char> buffer = decompress(inBuffer.get(), inSize, result, length);
-  if (result == ERROR_NONE) {
-    outFile.write(reinterpret_cast<char*>(buffer.get()), length);
+  if (size == 0) {
+    return ERROR_NONE;
   }
+  return inflateStream(inBuffer, dataOffset, size, outSize, &outFile, nullptr);
+}
 
-  return result;
+
+// smaller files are written normally, mapping them costs more than the copy
+static const BSAULong MIN_MAPPED_OUTPUT = 256 * 1024;
+
+
+bool Archive::mapOutput(BSAULong size) const
+{
+  return m_ExtractMappedOutput && (size >= MIN_MAPPED_OUTPUT);
+}
+
+
+bool Archive::directCopy() const
+{
+#ifdef WIN32
+  return false;
+#else
+  return !mapped();
+#endif // WIN32
+}
+
+
+EErrorCode Archive::copyUncompressed(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const
+{
+#ifdef WIN32
+  return extractDirect(dataOffset, size, outFile);
+#else
+  if (!skipNamePrefix(dataOffset, size)) {
+    return ERROR_INVALIDDATA;
+  } else if (m_DataFile->copyTo(outFile.descriptor(), size, dataOffset) != size) {
+    // either the archive is truncated or the output couldn't be written
+    return ERROR_INVALIDDATA;
+  }
+  return ERROR_NONE;
+#endif // WIN32
 }
 
 
 EErrorCode Archive::extract(File::Ptr file, const char *outputDirectory) const
 {
+  if (!OutputDirectory::validFileName(file->getName().c_str())) {
+    return ERROR_INVALIDDATA;
+  }
   std::string fileName = makeString("%s/%s", outputDirectory, file->getName().c_str());
-  std::ofstream outputFile(fileName.c_str(), fstream::out | fstream::binary | fstream::trunc);
-  if (!outputFile.is_open()) {
+  OutputFile outputFile;
+  if (!outputFile.open(fileName.c_str())) {
     return ERROR_ACCESSFAILED;
   }
+  return extractData(file->m_DataOffset, file->m_FileSize,
+                     compressed(file->compressToggled()), outputFile);
+}
 
+
+EErrorCode Archive::extractData(BSAULong dataOffset, BSAULong size, bool isCompressed,
+                                OutputFile &outFile) const
+{
   EErrorCode result = ERROR_NONE;
-  if ((defaultCompressed() && !file->compressToggled()) ||
-      (!defaultCompressed() && file->compressToggled())) {
-    result = extractCompressed(file, outputFile);
+  if (isCompressed) {
+    result = extractCompressed(dataOffset, size, outFile);
+  } else if (directCopy()) {
+    result = copyUncompressed(dataOffset, size, outFile);
   } else {
-    result = extractDirect(file, outputFile);
+    result = extractDirect(dataOffset, size, outFile);
+  }
+  if (!outFile.close() && (result == ERROR_NONE)) {
+    result = ERROR_ACCESSFAILED;
   }
-  outputFile.close();
   return result;
 }
 
 
-void Archive::readFiles(std::queue<FileInfo> &queue, boost::mutex &mutex,
-                        boost::interprocess::interprocess_semaphore &bufferCount,
-                        boost::interprocess::interprocess_semaphore &queueFree,
-                        std::vector<File::Ptr>::iterator begin, std::vector<File::Ptr>::iterator end)
+EErrorCode Archive::locateFileData(const File &file, const unsigned char *&data,
+                                   BSAULong &dataOffset, BSAULong &inSize, BSAULong &outSize) const
 {
-  for (; begin != end && !boost::this_thread::interruption_requested(); ++begin) {
-    queueFree.wait();
-
-    FileInfo fileInfo;
-    fileInfo.file = *begin;
-    size_t size = static_cast<size_t>(fileInfo.file->m_FileSize);
-
-    m_File.seekg(fileInfo.file->m_DataOffset);
-    if (namePrefixed()) {
-      std::string fullName = readBString(m_File);
-      if (size <= fullName.length()) {
-#pragma message("report error!")
-        continue;
-      }
-      size -= fullName.length() + 1;
+  inSize = file.m_FileSize;
+  dataOffset = file.m_DataOffset;
+  data = nullptr;
+  if (mapped()) {
+    data = reinterpret_cast<const unsigned char*>(mappedData(file.m_DataOffset, inSize));
+    if (data == nullptr) {
+      return ERROR_INVALIDDATA;
     }
-    fileInfo.data = std::make_pair(
-        boost::shared_array<unsigned char>(new unsigned char[size]),
-        static_cast<BSAULong>(size));
-    m_File.read(reinterpret_cast<char*>(fileInfo.data.first.get()), size);
-
-    {
-      boost::interprocess::scoped_lock<boost::mutex> lock(mutex);
-      queue.push(fileInfo);
-    }
-    bufferCount.post();
+  } else if (!skipNamePrefix(dataOffset, inSize)) {
+    return ERROR_INVALIDDATA;
   }
-}
 
+  outSize = inSize;
+  if (!compressed(file.compressToggled()) || (inSize == 0)) {
+    return ERROR_NONE;
+  }
 
-inline bool fileExists(const std::string &name) {
-  struct stat buffer;
-  return stat(name.c_str(), &buffer) != -1;
+  // the file data has the original size prepended
+  if (inSize < sizeof(BSAULong)) {
+    return ERROR_INVALIDDATA;
+  }
+  if (mapped()) {
+    memcpy(&outSize, data, sizeof(BSAULong));
+    data += sizeof(BSAULong);
+  } else if (m_DataFile->read(&outSize, sizeof(BSAULong), dataOffset) != sizeof(BSAULong)) {
+    return ERROR_INVALIDDATA;
+  }
+  dataOffset += sizeof(BSAULong);
+  inSize -= sizeof(BSAULong);
+  return ERROR_NONE;
 }
 
 
-void Archive::extractFiles(const std::string &targetDirectory,
-                           std::queue<FileInfo> &queue, boost::mutex &mutex,
-                           boost::interprocess::interprocess_semaphore &bufferCount,
-                           boost::interprocess::interprocess_semaphore &queueFree,
-                           int totalFiles,
-                           bool overwrite,
-                           int &filesDone)
+EErrorCode Archive::readFileData(const File &file, const unsigned char *data, BSAULong dataOffset,
+                                 BSAULong inSize, unsigned char *buffer, BSAULong outSize) const
 {
-  for (int i = 0; i < totalFiles; ++i) {
-    bufferCount.wait();
-    if (boost::this_thread::interruption_requested()) {
-      break;
+  if (!compressed(file.compressToggled())) {
+    if (mapped()) {
+      memcpy(buffer, data, outSize);
+    } else if (m_DataFile->read(buffer, outSize, dataOffset) != outSize) {
+      return ERROR_INVALIDDATA;
     }
+    return ERROR_NONE;
+  }
 
-    FileInfo fileInfo;
+  if (outSize == 0) {
+    return ERROR_NONE;
+  }
 
-    {
-      boost::interprocess::scoped_lock<boost::mutex> lock(mutex);
-      fileInfo = queue.front();
-      ++filesDone;
-      queue.pop();
+  // decompress straight into the target buffer
+  boost::shared_array<unsigned char> inBuffer;
+  if (!mapped()) {
+    inBuffer = m_BufferPool->get(inSize);
+    if (m_DataFile->read(inBuffer.get(), inSize, dataOffset) != inSize) {
+      return ERROR_INVALIDDATA;
     }
-    queueFree.post();
-
-    DataBuffer dataBuffer = fileInfo.data;
+    data = inBuffer.get();
+  }
+  return threadInflater().inflate(data, inSize, buffer, outSize);
+}
 
-    std::string fileName = makeString("%s\\%s", targetDirectory.c_str(), fileInfo.file->getFilePath().c_str());
-    if (!overwrite && fileExists(fileName)) {
-      continue;
-    }
 
-    std::ofstream outputFile(fileName.c_str(), fstream::out | fstream::binary | fstream::trunc);
+EErrorCode Archive::getUncompressedSize(File::Ptr file, BSAULong &size) const
+{
+  const unsigned char *data = nullptr;
+  BSAULong dataOffset = 0UL;
+  BSAULong inSize = 0UL;
+  return locateFileData(*file, data, dataOffset, inSize, size);
+}
 
-    if (compressed(fileInfo.file)) {
-      if (!outputFile.is_open()) {
-#pragma message("report error!")
-        continue;
-        //return ERROR_ACCESSFAILED;
-      }
 
-      EErrorCode result = ERROR_NONE;
-      try {
-        BSAULong length = 0UL;
-        boost::shared_array<unsigned char> buffer = decompress(dataBuffer.first.get(), dataBuffer.second + sizeof(BSAULong),
-                                                               result, length);
-        if (buffer.get() != nullptr) {
-          outputFile.write(reinterpret_cast<char*>(buffer.get()), length);
-        }
-      } catch (const std::exception &) {
-#pragma message("report error!")
-        continue;
-      }
-    } else {
-      outputFile.write(reinterpret_cast<char*>(dataBuffer.first.get()), dataBuffer.second);
-    }
+EErrorCode Archive::readFile(File::Ptr file, unsigned char *buffer, BSAULong bufferSize,
+                             BSAULong &size) const
+{
+  const unsigned char *data = nullptr;
+  BSAULong dataOffset = 0UL;
+  BSAULong inSize = 0UL;
+  EErrorCode result = locateFileData(*file, data, dataOffset, inSize, size);
+  if (result != ERROR_NONE) {
+    return result;
   }
+  if (bufferSize < size) {
+    return ERROR_BUFFERTOOSMALL;
+  }
+  return readFileData(*file, data, dataOffset, inSize, buffer, size);
 }
 
 
-void Archive::createFolders(const std::string &targetDirectory, Folder::Ptr folder)
+EErrorCode Archive::readFile(File::Ptr file, DataBuffer &data) const
 {
-  for (std::vector<Folder::Ptr>::iterator iter = folder->m_SubFolders.begin();
-       iter != folder->m_SubFolders.end(); ++iter) {
-    std::string subDirName = targetDirectory + "\\" + (*iter)->getName();
-    ::CreateDirectoryA(subDirName.c_str(), nullptr);
-    createFolders(subDirName, *iter);
+  const unsigned char *fileData = nullptr;
+  BSAULong dataOffset = 0UL;
+  BSAULong inSize = 0UL;
+  BSAULong size = 0UL;
+  EErrorCode result = locateFileData(*file, fileData, dataOffset, inSize, size);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  // not taken from the buffer pool, the buffer may outlive the archive
+  boost::shared_array<unsigned char> buffer(new unsigned char[(std::max)(size, static_cast<BSAULong>(1))]);
+  result = readFileData(*file, fileData, dataOffset, inSize, buffer.get(), size);
+  if (result == ERROR_NONE) {
+    data = std::make_pair(buffer, size);
   }
+  return result;
 }
 
 
-EErrorCode Archive::extractAll(const char *outputDirectory,
-                               const boost::function<bool (int value, std::string fileName)> &progress,
-                               bool overwrite)
+struct Archive::ExtractQueue {
+  ExtractQueue(size_t budget, bool overwriteFiles,
+               const FileCallback &fileCallback, const FinishedCallback &finishedCallback)
+    : filesQueued(0), memoryBudget(budget), memoryUsed(0),
+      overwrite(overwriteFiles), fileDone(fileCallback), finished(finishedCallback),
+      filesDone(0), lastFile(ArchiveIndex::NOT_FOUND), threadsRunning(0),
+      done(false), result(ERROR_NONE), canceled(false) {}
+
+  /**
+   * count a file as done and report it to the callback
+   */
+  void fileFinished(const Archive &archive, BSAULong file, EErrorCode fileResult);
+
+  /**
+   * called by each thread of the extraction when it is done. The last one
+   * finishes the extraction
+   */
+  void threadFinished();
+
+  /**
+   * finish the extraction, report the result and wake up all waiting threads
+   */
+  void finish(EErrorCode extractionResult);
+
+  /**
+   * wait until the memory for a file fits into the budget and reserve it.
+   * A file is always admitted if no memory is in use
+   */
+  void reserveMemory(size_t memory);
+  /**
+   * reserve the memory for a file if it fits into the budget right now
+   */
+  bool tryReserveMemory(size_t memory);
+  void releaseMemory(size_t memory);
+
+  /**
+   * hand a file to the workers
+   */
+  void push(const FileInfo &fileInfo);
+
+  boost::mutex mutex;
+  std::queue<FileInfo> files;
+  boost::interprocess::interprocess_semaphore filesQueued;
+  // signaled when queued files have been written and their memory is free again
+  boost::condition_variable memoryFreed;
+  size_t memoryBudget;
+  size_t memoryUsed;
+
+  // index entries of the files to extract, ordered by data offset
+  std::vector<BSAULong> fileList;
+  // folders containing the files in ascending order, and the output tree
+  // with the same folders
+  std::vector<BSAULong> folders;
+  OutputDirectory output;
+  // files that exist already and aren't overwritten. They are reported as
+  // done without being read
+  std::vector<BSAULong> skippedFiles;
+  bool overwrite;
+  FileCallback fileDone;
+  FinishedCallback finished;
+
+  // signaled whenever a file is done and once the extraction has finished
+  boost::condition_variable progress;
+  BSAULong filesDone;
+  BSAULong lastFile;
+  unsigned int threadsRunning;
+  bool done;
+  EErrorCode result;
+
+  std::atomic<bool> canceled;
+};
+
+
+void Archive::ExtractQueue::fileFinished(const Archive &archive, BSAULong file, EErrorCode fileResult)
 {
-#pragma message("report errors")
-  createFolders(outputDirectory, m_RootFolder);
-
-  std::vector<File::Ptr> fileList;
-  m_RootFolder->collectFiles(fileList);
-  std::sort(fileList.begin(), fileList.end(), ByOffset);
-  m_File.seekg((*(fileList.begin()))->m_DataOffset);
-
-  std::queue<FileInfo> buffers;
-  boost::mutex queueMutex;
-  int filesDone = 0;
-  boost::interprocess::interprocess_semaphore bufferCount(0);
-  boost::interprocess::interprocess_semaphore queueFree(100);
-
-  boost::thread readerThread(boost::bind(&Archive::readFiles, this,
-                                         boost::ref(buffers), boost::ref(queueMutex),
-                                         boost::ref(bufferCount), boost::ref(queueFree),
-                                         fileList.begin(), fileList.end()));
-
-  boost::thread extractThread(boost::bind(
-      &Archive::extractFiles, this, outputDirectory, boost::ref(buffers),
-      boost::ref(queueMutex), boost::ref(bufferCount), boost::ref(queueFree),
-      static_cast<int>(fileList.size()), overwrite, boost::ref(filesDone)));
-
-  bool readerDone  = false;
-  bool extractDone = false;
-  bool canceled = false;
-  while (!readerDone || !extractDone) {
-    if (!readerDone) {
-      readerDone = readerThread.timed_join(boost::posix_time::millisec(100));
-    }
-    if (readerDone) {
-      extractDone = extractThread.timed_join(boost::posix_time::millisec(100));
-      // don't cancel extractor before reader is done or else reader may be stuck trying to write to a queue
-      if (canceled) {
-        // ensure the extract thread wakes up.
-        extractThread.interrupt();
-        bufferCount.post();
-      }
-    }
-    size_t index
-        = (std::min)(static_cast<size_t>(filesDone), fileList.size() - 1);
-    if (!progress((filesDone * 100) / static_cast<int>(fileList.size()),
-                  fileList[index]->getName())
-        && !canceled) {
-      readerThread.interrupt();
-      canceled = true; // don't interrupt repeatedly
-    }
+  if (!fileDone.empty()) {
+    fileDone(archive.filePath(file), fileResult);
   }
-
-  return ERROR_NONE;
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    ++filesDone;
+    lastFile = file;
+  }
+  progress.notify_all();
+}
+
+
+void Archive::ExtractQueue::threadFinished()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if (--threadsRunning != 0) {
+      return;
+    }
+  }
+  finish(canceled ? ERROR_CANCELED : ERROR_NONE);
+}
+
+
+void Archive::ExtractQueue::finish(EErrorCode extractionResult)
+{
+  // the callback runs before waiting threads are released, so it's done
+  // by the time wait returns
+  if (!finished.empty()) {
+    finished(extractionResult);
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    result = extractionResult;
+    done = true;
+  }
+  progress.notify_all();
+}
+
+
+void Archive::ExtractQueue::reserveMemory(size_t memory)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  while ((memoryUsed != 0) && (memoryUsed + memory > memoryBudget)) {
+    memoryFreed.wait(lock);
+  }
+  memoryUsed += memory;
+}
+
+
+bool Archive::ExtractQueue::tryReserveMemory(size_t memory)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  if ((memoryUsed != 0) && (memoryUsed + memory > memoryBudget)) {
+    return false;
+  }
+  memoryUsed += memory;
+  return true;
+}
+
+
+void Archive::ExtractQueue::releaseMemory(size_t memory)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    memoryUsed -= memory;
+  }
+  memoryFreed.notify_all();
+}
+
+
+void Archive::ExtractQueue::push(const FileInfo &fileInfo)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    files.push(fileInfo);
+  }
+  filesQueued.post();
+}
+
+
+void Archive::Extraction::cancel()
+{
+  m_Queue->canceled = true;
+}
+
+
+bool Archive::Extraction::finished() const
+{
+  boost::mutex::scoped_lock lock(m_Queue->mutex);
+  return m_Queue->done;
+}
+
+
+EErrorCode Archive::Extraction::wait() const
+{
+  boost::mutex::scoped_lock lock(m_Queue->mutex);
+  while (!m_Queue->done) {
+    m_Queue->progress.wait(lock);
+  }
+  return m_Queue->result;
+}
+
+
+BSAULong Archive::Extraction::waitForProgress(BSAULong filesDone) const
+{
+  boost::mutex::scoped_lock lock(m_Queue->mutex);
+  while (!m_Queue->done && (m_Queue->filesDone <= filesDone)) {
+    m_Queue->progress.wait(lock);
+  }
+  return m_Queue->filesDone;
+}
+
+
+BSAULong Archive::Extraction::fileCount() const
+{
+  return static_cast<BSAULong>(m_Queue->fileList.size() + m_Queue->skippedFiles.size());
+}
+
+
+void Archive::readFiles(std::shared_ptr<ExtractQueue> queue, unsigned int workerCount)
+{
+  for (std::vector<BSAULong>::const_iterator iter = queue->skippedFiles.begin();
+       (iter != queue->skippedFiles.end()) && !queue->canceled; ++iter) {
+    queue->fileFinished(*this, *iter, ERROR_NONE);
+  }
+
+  bool done = false;
+#ifdef BSA_HAVE_IO_URING
+  if (m_ExtractIoRing && !mapped()) {
+    done = readFilesIoRing(*queue);
+  }
+#endif // BSA_HAVE_IO_URING
+  if (!done) {
+    readFilesSequential(*queue);
+  }
+
+  // an empty queue tells the workers to stop
+  for (unsigned int i = 0; i < workerCount; ++i) {
+    queue->filesQueued.post();
+  }
+  queue->threadFinished();
+}
+
+
+EErrorCode Archive::extractLargeFile(const ExtractQueue &queue, BSAULong file) const
+{
+  OutputFile outputFile;
+  EErrorCode result = openOutputFile(queue, file, outputFile);
+  if ((result != ERROR_NONE) || !outputFile.isOpen()) {
+    return result;
+  }
+  return extractData(m_Index.fileOffset(file), m_Index.fileSize(file),
+                     compressed(m_Index.fileCompressToggled(file)), outputFile);
+}
+
+
+// runs of adjacent files are read with a single request of up to this size
+static const BSAULong COALESCE_SIZE = 4 * 1024 * 1024;
+// gaps up to this size between files are read along with them
+static const BSAULong COALESCE_GAP = 4 * 1024;
+
+
+void Archive::readFilesSequential(ExtractQueue &queue)
+{
+  std::vector<BSAULong>::const_iterator iter = queue.fileList.begin();
+  while ((iter != queue.fileList.end()) && !queue.canceled) {
+    std::vector<BSAULong>::const_iterator runEnd = findAdjacentFiles(queue, iter);
+    if (runEnd - iter > 1) {
+      readAdjacentFiles(queue, iter, runEnd);
+      iter = runEnd;
+    } else {
+      queueFile(queue, *iter);
+      ++iter;
+    }
+  }
+}
+
+
+void Archive::queueFile(ExtractQueue &queue, BSAULong file)
+{
+  FileInfo fileInfo;
+  fileInfo.file = file;
+  fileInfo.copy = false;
+
+  BSAULong size = m_Index.fileSize(fileInfo.file);
+  BSAULong offset = m_Index.fileOffset(fileInfo.file);
+  bool isCompressed = compressed(m_Index.fileCompressToggled(fileInfo.file));
+  const char *data = nullptr;
+
+  if (!isCompressed && directCopy()) {
+    // the worker copies the data itself, it never has to be buffered
+    fileInfo.copy = true;
+    fileInfo.memory = 0;
+    queue.push(fileInfo);
+    return;
+  }
+
+  bool valid = true;
+  if (mapped()) {
+    data = mappedData(offset, size);
+    valid = data != nullptr;
+  } else {
+    valid = skipNamePrefix(offset, size);
+  }
+
+  if (!valid
+      || (isCompressed && (size > 0) && (size < sizeof(BSAULong)))) {
+    queue.fileFinished(*this, fileInfo.file, ERROR_INVALIDDATA);
+    return;
+  }
+
+  // mapped data doesn't need to be buffered. The workers decompress in
+  // chunks so the decompressed size doesn't matter
+  fileInfo.memory = mapped() ? 0 : size;
+
+  if (fileInfo.memory > queue.memoryBudget / 4) {
+    // too large to be queued without starving the workers, extract it
+    // from here instead
+    queue.fileFinished(*this, fileInfo.file, extractLargeFile(queue, fileInfo.file));
+    return;
+  }
+
+  queue.reserveMemory(fileInfo.memory);
+
+  if (mapped()) {
+    // hand out the mapped data directly, no copy required
+    fileInfo.data = std::make_pair(
+        boost::shared_array<unsigned char>(
+          reinterpret_cast<unsigned char*>(const_cast<char*>(data)), boost::null_deleter()),
+        size);
+  } else {
+    fileInfo.data = std::make_pair(m_BufferPool->get(size), size);
+    if (m_DataFile->read(fileInfo.data.first.get(), size, offset) != size) {
+      fileInfo.data.first.reset();
+      queue.releaseMemory(fileInfo.memory);
+      queue.fileFinished(*this, fileInfo.file, ERROR_INVALIDDATA);
+      return;
+    }
+  }
+
+  queue.push(fileInfo);
+}
+
+
+std::vector<BSAULong>::const_iterator Archive::findAdjacentFiles(
+    const ExtractQueue &queue, std::vector<BSAULong>::const_iterator begin) const
+{
+  // mapped data is never copied, and copied files aren't read at all
+  if (mapped() || (!compressed(m_Index.fileCompressToggled(*begin)) && directCopy())) {
+    return begin + 1;
+  }
+
+  BSAULong maxSize = (std::min)(COALESCE_SIZE, static_cast<BSAULong>(queue.memoryBudget / 4));
+  BSAULong runStart = m_Index.fileOffset(*begin);
+  BSAULong runEnd = runStart + m_Index.fileSize(*begin);
+  std::vector<BSAULong>::const_iterator iter = begin + 1;
+  for (; iter != queue.fileList.end(); ++iter) {
+    if (!compressed(m_Index.fileCompressToggled(*iter)) && directCopy()) {
+      break;
+    }
+    BSAULong offset = m_Index.fileOffset(*iter);
+    BSAULong end = offset + m_Index.fileSize(*iter);
+    if ((offset < runEnd) || (offset - runEnd > COALESCE_GAP)
+        || (end < offset) || (end - runStart > maxSize)) {
+      break;
+    }
+    runEnd = end;
+  }
+  return iter;
+}
+
+
+void Archive::readAdjacentFiles(ExtractQueue &queue, std::vector<BSAULong>::const_iterator begin,
+                                std::vector<BSAULong>::const_iterator end)
+{
+  BSAULong runStart = m_Index.fileOffset(*begin);
+  BSAULong runSize = m_Index.fileOffset(*(end - 1)) + m_Index.fileSize(*(end - 1)) - runStart;
+
+  // the budget is reserved for the whole block and split among its files,
+  // each file releasing its share once written. The block itself is freed
+  // with its last file, workers take files in order so that's soon after
+  queue.reserveMemory(runSize);
+  boost::shared_array<unsigned char> block = m_BufferPool->get(runSize);
+  if (m_DataFile->read(block.get(), runSize, runStart) != runSize) {
+    // the archive is probably truncated. Read the files one by one so all
+    // those that are complete are extracted
+    block.reset();
+    queue.releaseMemory(runSize);
+    for (std::vector<BSAULong>::const_iterator iter = begin; iter != end; ++iter) {
+      queueFile(queue, *iter);
+    }
+    return;
+  }
+
+  for (std::vector<BSAULong>::const_iterator iter = begin; iter != end; ++iter) {
+    FileInfo fileInfo;
+    fileInfo.file = *iter;
+    fileInfo.copy = false;
+    BSAULong offset = m_Index.fileOffset(*iter) - runStart;
+    // gaps are accounted to the file before them
+    fileInfo.memory = ((iter + 1) != end ? m_Index.fileOffset(*(iter + 1)) - runStart : runSize) - offset;
+    fileInfo.data = std::make_pair(
+          boost::shared_array<unsigned char>(block, block.get() + offset),
+          m_Index.fileSize(*iter));
+    if (!trimFileData(fileInfo)) {
+      fileInfo.data.first.reset();
+      queue.releaseMemory(fileInfo.memory);
+      queue.fileFinished(*this, fileInfo.file, ERROR_INVALIDDATA);
+      continue;
+    }
+    queue.push(fileInfo);
+  }
+}
+
+
+bool Archive::trimFileData(FileInfo &fileInfo) const
+{
+  unsigned char *buffer = fileInfo.data.first.get();
+  BSAULong size = fileInfo.data.second;
+  if (namePrefixed() && (size > 0)) {
+    BSAULong prefixLength = buffer[0] + 1;
+    if (prefixLength > size) {
+      return false;
+    }
+    fileInfo.data = std::make_pair(
+          boost::shared_array<unsigned char>(fileInfo.data.first, buffer + prefixLength),
+          size - prefixLength);
+  }
+  if (compressed(m_Index.fileCompressToggled(fileInfo.file))) {
+    return (fileInfo.data.second == 0) || (fileInfo.data.second >= sizeof(BSAULong));
+  }
+  return true;
+}
+
+
+#ifdef BSA_HAVE_IO_URING
+
+// maximum number of archive reads in flight
+static const unsigned int IORING_DEPTH = 64;
+// queued reads are submitted once there are this many
+static const unsigned int IORING_BATCH = 16;
+
+
+bool Archive::readFilesIoRing(ExtractQueue &queue)
+{
+  IoRing ring;
+  if (!ring.init(IORING_DEPTH)) {
+    return false;
+  }
+  int fd = m_DataFile->descriptor();
+
+  // files being read, indexed by the user data of their request
+  std::vector<FileInfo> reading(IORING_DEPTH);
+  std::vector<unsigned int> freeSlots;
+  for (unsigned int i = 0; i < IORING_DEPTH; ++i) {
+    freeSlots.push_back(IORING_DEPTH - 1 - i);
+  }
+
+  for (std::vector<BSAULong>::const_iterator iter = queue.fileList.begin();
+       (iter != queue.fileList.end()) && !queue.canceled; ++iter) {
+    BSAULong file = *iter;
+    // the whole blob is read, including the name prefix
+    BSAULong size = m_Index.fileSize(file);
+
+    if (!compressed(m_Index.fileCompressToggled(file))) {
+      // directCopy is always true here, the worker copies the data itself
+      FileInfo fileInfo;
+      fileInfo.file = file;
+      fileInfo.memory = 0;
+      fileInfo.copy = true;
+      queue.push(fileInfo);
+      continue;
+    }
+
+    if (size > queue.memoryBudget / 4) {
+      queue.fileFinished(*this, file, extractLargeFile(queue, file));
+      continue;
+    }
+
+    // reads in flight count against the budget but can't be freed by the
+    // workers yet, so they are completed before waiting for memory
+    for (;;) {
+      if (!freeSlots.empty() && queue.tryReserveMemory(size)) {
+        break;
+      } else if (freeSlots.size() < reading.size()) {
+        completeReads(queue, ring, reading, freeSlots);
+      } else {
+        queue.reserveMemory(size);
+        break;
+      }
+    }
+
+    unsigned int slot = freeSlots.back();
+    freeSlots.pop_back();
+    FileInfo &fileInfo = reading[slot];
+    fileInfo.file = file;
+    fileInfo.memory = size;
+    fileInfo.copy = false;
+    fileInfo.data = std::make_pair(m_BufferPool->get(size), size);
+    if ((size == 0)
+        || !ring.queueRead(fd, fileInfo.data.first.get(), size, m_Index.fileOffset(file), slot)) {
+      finishRead(queue, fileInfo, 0);
+      freeSlots.push_back(slot);
+    } else if (ring.queued() >= IORING_BATCH) {
+      ring.submit(0);
+    }
+  }
+
+  // buffers mustn't be released while the kernel may still write to them
+  while (freeSlots.size() < reading.size()) {
+    completeReads(queue, ring, reading, freeSlots);
+  }
+
+  return true;
+}
+
+
+void Archive::completeReads(ExtractQueue &queue, IoRing &ring,
+                            std::vector<FileInfo> &reading, std::vector<unsigned int> &freeSlots)
+{
+  if (!ring.submit(1)) {
+    // the kernel is short on resources, the caller tries again
+    boost::this_thread::yield();
+    return;
+  }
+
+  unsigned long long slot = 0;
+  int result = 0;
+  while (ring.popCompletion(slot, result)) {
+    finishRead(queue, reading[slot], result);
+    freeSlots.push_back(static_cast<unsigned int>(slot));
+  }
+}
+
+
+void Archive::finishRead(ExtractQueue &queue, FileInfo &fileInfo, int result)
+{
+  FileInfo finished = fileInfo;
+  fileInfo = FileInfo();
+
+  unsigned char *buffer = finished.data.first.get();
+  BSAULong size = finished.data.second;
+  BSAULong offset = m_Index.fileOffset(finished.file);
+
+  // failed and short reads are completed synchronously
+  BSAULong done = result > 0 ? (std::min)(static_cast<BSAULong>(result), size) : 0;
+  if (done < size) {
+    done += static_cast<BSAULong>(m_DataFile->read(buffer + done, size - done, offset + done));
+  }
+
+  if ((done != size) || !trimFileData(finished)) {
+    finished.data.first.reset();
+    queue.releaseMemory(finished.memory);
+    queue.fileFinished(*this, finished.file, ERROR_INVALIDDATA);
+    return;
+  }
+  queue.push(finished);
+}
+
+#endif // BSA_HAVE_IO_URING
+
+
+EErrorCode Archive::openOutputFile(const ExtractQueue &queue, BSAULong file, OutputFile &outFile) const
+{
+  size_t folder = std::lower_bound(queue.folders.begin(), queue.folders.end(), m_Index.fileFolder(file))
+                  - queue.folders.begin();
+  if (!queue.output.valid(folder, m_Index.fileName(file))) {
+    // the path would leave the target directory
+    return ERROR_INVALIDDATA;
+  }
+  if (queue.output.open(folder, m_Index.fileName(file), outFile, queue.overwrite)) {
+    return ERROR_NONE;
+  }
+  // existing files were skipped up front, but the file may have been
+  // created since. It's still not overwritten
+  return outFile.existed() ? ERROR_NONE : ERROR_ACCESSFAILED;
+}
+
+
+EErrorCode Archive::writeFile(const FileInfo &fileInfo, const ExtractQueue &queue) const
+{
+  OutputFile outputFile;
+  EErrorCode result = openOutputFile(queue, fileInfo.file, outputFile);
+  if ((result != ERROR_NONE) || !outputFile.isOpen()) {
+    return result;
+  }
+
+  if (fileInfo.copy) {
+    return extractData(m_Index.fileOffset(fileInfo.file), m_Index.fileSize(fileInfo.file),
+                       false, outputFile);
+  }
+
+  const DataBuffer &dataBuffer = fileInfo.data;
+  bool isCompressed = compressed(m_Index.fileCompressToggled(fileInfo.file));
+  if (isCompressed && (dataBuffer.second >= sizeof(BSAULong))) {
+    BSAULong outSize = 0UL;
+    memcpy(&outSize, dataBuffer.first.get(), sizeof(BSAULong));
+    MappedOutputFile mappedFile;
+    if (mapOutput(outSize) && mappedFile.map(outputFile, outSize)) {
+      // the whole compressed data is in memory, decompress it in one call
+      result = threadInflater().inflate(dataBuffer.first.get() + sizeof(BSAULong),
+                                        dataBuffer.second - static_cast<BSAULong>(sizeof(BSAULong)),
+                                        mappedFile.data(), outSize);
+      if ((!mappedFile.unmap() || !outputFile.close()) && (result == ERROR_NONE)) {
+        result = ERROR_ACCESSFAILED;
+      }
+      return result;
+    }
+  }
+
+  if (isCompressed) {
+    if (dataBuffer.second >= sizeof(BSAULong)) {
+      BSAULong outSize = 0UL;
+      memcpy(&outSize, dataBuffer.first.get(), sizeof(BSAULong));
+      const unsigned char *inBuffer = dataBuffer.first.get() + sizeof(BSAULong);
+      BSAULong inSize = dataBuffer.second - static_cast<BSAULong>(sizeof(BSAULong));
+      if (outSize <= MAX_ONESHOT_INFLATE) {
+        // small files are decompressed in one call, which is faster than
+        // in chunks, especially with libdeflate
+        boost::shared_array<unsigned char> buffer = m_BufferPool->get(outSize);
+        result = threadInflater().inflate(inBuffer, inSize, buffer.get(), outSize);
+        if ((result == ERROR_NONE) && !outputFile.write(buffer.get(), outSize)) {
+          result = ERROR_ACCESSFAILED;
+        }
+      } else {
+        result = inflateStream(inBuffer, 0, inSize, outSize, &outputFile, nullptr);
+      }
+    } else if (dataBuffer.second != 0) {
+      result = ERROR_INVALIDDATA;
+    }
+  } else if (!outputFile.write(dataBuffer.first.get(), dataBuffer.second)) {
+    result = ERROR_ACCESSFAILED;
+  }
+  if (!outputFile.close() && (result == ERROR_NONE)) {
+    result = ERROR_ACCESSFAILED;
+  }
+  return result;
+}
+
+
+void Archive::writeQueuedFiles(std::shared_ptr<ExtractQueue> queue)
+{
+  for (;;) {
+    queue->filesQueued.wait();
+
+    FileInfo fileInfo;
+
+    {
+      boost::mutex::scoped_lock lock(queue->mutex);
+      if (queue->files.empty()) {
+        // reader is done
+        break;
+      }
+      fileInfo = queue->files.front();
+      queue->files.pop();
+    }
+
+    // if canceled, keep draining the queue so the reader can finish
+    if (!queue->canceled) {
+      EErrorCode result = writeFile(fileInfo, *queue);
+      queue->fileFinished(*this, fileInfo.file, result);
+    }
+
+    fileInfo.data.first.reset();
+    queue->releaseMemory(fileInfo.memory);
+  }
+  queue->threadFinished();
+}
+
+
+bool Archive::createFolders(ExtractQueue &queue, const std::string &targetDirectory,
+                            std::vector<BSAULong> &folders)
+{
+  queue.folders.swap(folders);
+  std::vector<std::string> paths;
+  paths.reserve(queue.folders.size());
+  for (std::vector<BSAULong>::const_iterator iter = queue.folders.begin();
+       iter != queue.folders.end(); ++iter) {
+    paths.push_back(m_Index.folderName(*iter));
+  }
+  return queue.output.create(targetDirectory, paths);
+}
+
+
+void Archive::skipExistingFiles(ExtractQueue &queue) const
+{
+  std::vector<BSAULong> remaining;
+  std::vector<BSAULong>::const_iterator iter = queue.fileList.begin();
+  std::vector<BSAULong>::iterator position = queue.folders.begin();
+  while (iter != queue.fileList.end()) {
+    // the files of each folder are next to each other in index order
+    BSAULong folder = m_Index.fileFolder(*iter);
+    BSAULong lastFile = m_Index.firstFile(folder) + m_Index.folderFileCount(folder);
+    std::vector<BSAULong>::const_iterator folderEnd = iter;
+    std::vector<const char*> fileNames;
+    for (; (folderEnd != queue.fileList.end()) && (*folderEnd < lastFile); ++folderEnd) {
+      fileNames.push_back(m_Index.fileName(*folderEnd));
+    }
+
+    position = std::lower_bound(position, queue.folders.end(), folder);
+    std::vector<bool> exists;
+    queue.output.findExisting(position - queue.folders.begin(), fileNames, exists);
+    for (size_t i = 0; i < exists.size(); ++i) {
+      if (exists[i]) {
+        queue.skippedFiles.push_back(iter[i]);
+      } else {
+        remaining.push_back(iter[i]);
+      }
+    }
+    iter = folderEnd;
+  }
+  queue.fileList.swap(remaining);
+}
+
+
+// orders index entries by the offset of their data
+class ByOffsetInIndex {
+public:
+  explicit ByOffsetInIndex(const ArchiveIndex &index) : m_Index(index) {}
+  bool operator()(BSAULong LHS, BSAULong RHS) const {
+    return m_Index.fileOffset(LHS) < m_Index.fileOffset(RHS);
+  }
+private:
+  const ArchiveIndex &m_Index;
+};
+
+
+EErrorCode Archive::extractAll(const char *outputDirectory,
+                               const boost::function<bool (int value, std::string fileName)> &progress,
+                               bool overwrite)
+{
+  return waitForExtraction(extractAllAsync(outputDirectory, overwrite), progress);
+}
+
+
+EErrorCode Archive::extractFiles(const std::vector<File::Ptr> &files, const char *outputDirectory,
+                                 const boost::function<bool (int value, std::string fileName)> &progress,
+                                 bool overwrite)
+{
+  return waitForExtraction(extractFilesAsync(files, outputDirectory, overwrite), progress);
+}
+
+
+EErrorCode Archive::extractFiles(const boost::function<bool (const std::string &path)> &filter,
+                                 const char *outputDirectory,
+                                 const boost::function<bool (int value, std::string fileName)> &progress,
+                                 bool overwrite)
+{
+  return waitForExtraction(extractFilesAsync(filter, outputDirectory, overwrite), progress);
+}
+
+
+Archive::Extraction::Ptr Archive::extractAllAsync(const char *outputDirectory, bool overwrite,
+                                                  const FileCallback &fileDone,
+                                                  const FinishedCallback &finished)
+{
+  EErrorCode result = resolveFileNames();
+  if (result != ERROR_NONE) {
+    return failedExtraction(result, finished);
+  }
+
+  std::vector<BSAULong> folders;
+  folders.reserve(m_Index.numFolders());
+  for (BSAULong i = 0; i < m_Index.numFolders(); ++i) {
+    folders.push_back(i);
+  }
+
+  std::vector<BSAULong> fileList;
+  fileList.reserve(m_Index.numFiles());
+  for (BSAULong i = 0; i < m_Index.numFiles(); ++i) {
+    fileList.push_back(i);
+  }
+  return startExtraction(fileList, folders, outputDirectory, overwrite, fileDone, finished);
+}
+
+
+Archive::Extraction::Ptr Archive::extractFilesAsync(const std::vector<File::Ptr> &files,
+                                                    const char *outputDirectory, bool overwrite,
+                                                    const FileCallback &fileDone,
+                                                    const FinishedCallback &finished)
+{
+  EErrorCode result = resolveFileNames();
+  if (result != ERROR_NONE) {
+    return failedExtraction(result, finished);
+  }
+
+  std::vector<BSAULong> fileList;
+  fileList.reserve(files.size());
+  for (std::vector<File::Ptr>::const_iterator iter = files.begin();
+       iter != files.end(); ++iter) {
+    BSAULong entry = (*iter)->m_IndexEntry;
+    if ((entry >= m_FileViews.size()) || (m_FileViews[entry] != *iter)) {
+      return failedExtraction(ERROR_FILENOTFOUND, finished);
+    }
+    fileList.push_back(entry);
+  }
+
+  // the same file listed twice would be written by two workers at once
+  std::sort(fileList.begin(), fileList.end());
+  fileList.erase(std::unique(fileList.begin(), fileList.end()), fileList.end());
+
+  std::vector<BSAULong> folders;
+  for (std::vector<BSAULong>::const_iterator iter = fileList.begin();
+       iter != fileList.end(); ++iter) {
+    BSAULong folder = m_Index.fileFolder(*iter);
+    if (folders.empty() || (folders.back() != folder)) {
+      folders.push_back(folder);
+    }
+  }
+  return startExtraction(fileList, folders, outputDirectory, overwrite, fileDone, finished);
+}
+
+
+Archive::Extraction::Ptr Archive::extractFilesAsync(const boost::function<bool (const std::string &path)> &filter,
+                                                    const char *outputDirectory, bool overwrite,
+                                                    const FileCallback &fileDone,
+                                                    const FinishedCallback &finished)
+{
+  EErrorCode result = resolveFileNames();
+  if (result != ERROR_NONE) {
+    return failedExtraction(result, finished);
+  }
+
+  std::vector<BSAULong> fileList;
+  std::vector<BSAULong> folders;
+  for (BSAULong folder = 0; folder < m_Index.numFolders(); ++folder) {
+    BSAULong lastFile = m_Index.firstFile(folder) + m_Index.folderFileCount(folder);
+    bool selected = false;
+    for (BSAULong file = m_Index.firstFile(folder); file < lastFile; ++file) {
+      if (filter(filePath(file))) {
+        fileList.push_back(file);
+        selected = true;
+      }
+    }
+    if (selected) {
+      folders.push_back(folder);
+    }
+  }
+  return startExtraction(fileList, folders, outputDirectory, overwrite, fileDone, finished);
+}
+
+
+Archive::Extraction::Ptr Archive::startExtraction(std::vector<BSAULong> &fileList,
+                                                  std::vector<BSAULong> &folders,
+                                                  const std::string &targetDirectory, bool overwrite,
+                                                  const FileCallback &fileDone,
+                                                  const FinishedCallback &finished)
+{
+  std::shared_ptr<ExtractQueue> queue = std::make_shared<ExtractQueue>(
+        m_ExtractMemoryBudget, overwrite, fileDone, finished);
+  queue->fileList.swap(fileList);
+  Extraction::Ptr extraction(new Extraction(queue));
+
+  if (queue->fileList.empty()) {
+    queue->finish(ERROR_NONE);
+    return extraction;
+  }
+
+  if (!createFolders(*queue, targetDirectory, folders)) {
+    queue->finish(ERROR_ACCESSFAILED);
+    return extraction;
+  }
+  if (!overwrite) {
+    skipExistingFiles(*queue);
+  }
+
+  std::sort(queue->fileList.begin(), queue->fileList.end(), ByOffsetInIndex(m_Index));
+
+  unsigned int workerCount = m_ExtractThreadCount != 0 ? m_ExtractThreadCount
+                                                       : boost::thread::hardware_concurrency();
+  if (workerCount == 0) {
+    workerCount = 1;
+  } else if (workerCount > queue->fileList.size()) {
+    // may be 0 if all files are skipped, the reader still reports them
+    workerCount = static_cast<unsigned int>(queue->fileList.size());
+  }
+
+  // the threads run detached, each one keeps the queue alive
+  queue->threadsRunning = workerCount + 1;
+  boost::thread(boost::bind(&Archive::readFiles, this, queue, workerCount)).detach();
+  for (unsigned int i = 0; i < workerCount; ++i) {
+    boost::thread(boost::bind(&Archive::writeQueuedFiles, this, queue)).detach();
+  }
+
+  return extraction;
+}
+
+
+Archive::Extraction::Ptr Archive::failedExtraction(EErrorCode result, const FinishedCallback &finished)
+{
+  std::shared_ptr<ExtractQueue> queue = std::make_shared<ExtractQueue>(
+        0, false, FileCallback(), finished);
+  queue->finish(result);
+  return Extraction::Ptr(new Extraction(queue));
+}
+
+
+EErrorCode Archive::waitForExtraction(const Extraction::Ptr &extraction,
+                                      const boost::function<bool (int value, std::string fileName)> &progress) const
+{
+  ExtractQueue &queue = *extraction->m_Queue;
+  BSAULong filesDone = 0;
+  int lastPercentage = -1;
+  bool done = false;
+  while (!done) {
+    BSAULong lastFile = ArchiveIndex::NOT_FOUND;
+    {
+      boost::mutex::scoped_lock lock(queue.mutex);
+      while (!queue.done && (queue.filesDone <= filesDone)) {
+        queue.progress.wait(lock);
+      }
+      filesDone = queue.filesDone;
+      lastFile = queue.lastFile;
+      done = queue.done;
+    }
+    // only report changes of the percentage, not every file
+    int percentage = static_cast<int>((static_cast<unsigned long long>(filesDone) * 100)
+                                      / (std::max)(extraction->fileCount(), static_cast<BSAULong>(1)));
+    if ((percentage != lastPercentage) && (lastFile != ArchiveIndex::NOT_FOUND)) {
+      lastPercentage = percentage;
+      if (!progress(percentage, m_Index.fileName(lastFile))) {
+        extraction->cancel();
+      }
+    }
+  }
+  return extraction->wait();
 }
 
 
 bool Archive::compressed(const File::Ptr &file)
 {
-  return ((defaultCompressed() && !file->compressToggled()) ||
-          (!defaultCompressed() && file->compressToggled()));
+  return compressed(file->compressToggled());
 }
 
 File::Ptr Archive::createFile(const std::string &name, const std::string &sourceName,
@@ -26,8 +26,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "errorcodes.h"
 #include "bsatypes.h"
 #include "bsafolder.h"
+#include "bsaindex.h"
+#include "bsaioring.h"
 #include <vector>
 #include <queue>
+#include <memory>
 #ifndef Q_MOC_RUN
 #include <boost/function.hpp>
 #include <boost/shared_array.hpp>
@@ -35,9 +38,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 namespace boost {
-  class mutex;
   namespace interprocess {
-    class interprocess_semaphore;
+    class file_mapping;
+    class mapped_region;
   }
 }
 
@@ -46,6 +49,9 @@ namespace BSA {
 
 
 class File;
+class BufferPool;
+class PositionalFile;
+class OutputFile;
 
 
 /**
@@ -64,6 +70,68 @@ public:
 
   typedef std::pair<boost::shared_array<unsigned char>, BSAULong> DataBuffer;
 
+  // called after each file of an extraction with its path within the archive
+  typedef boost::function<void (const std::string &path, EErrorCode result)> FileCallback;
+  // called once when an extraction has finished
+  typedef boost::function<void (EErrorCode result)> FinishedCallback;
+
+private:
+
+  // state shared by the threads of an extraction
+  struct ExtractQueue;
+
+public:
+
+  /**
+   * @brief handle to an extraction running in the background, see extractAllAsync.
+   * Dropping the handle doesn't stop the extraction
+   */
+  class Extraction {
+
+    friend class Archive;
+
+  public:
+
+    typedef std::shared_ptr<Extraction> Ptr;
+
+  public:
+
+    /**
+     * ask the extraction to stop and return right away. Files being written
+     * are completed, the remaining files are skipped
+     */
+    void cancel();
+    /**
+     * @return true once the extraction has finished
+     */
+    bool finished() const;
+    /**
+     * block until the extraction has finished
+     * @return ERROR_NONE, ERROR_CANCELED if the extraction was canceled or the
+     *         error that prevented it from starting
+     */
+    EErrorCode wait() const;
+    /**
+     * block until more files are done than specified or the extraction has finished
+     * @param filesDone number of files already known to be done
+     * @return number of files done
+     */
+    BSAULong waitForProgress(BSAULong filesDone) const;
+    /**
+     * @return number of files to extract
+     */
+    BSAULong fileCount() const;
+
+  private:
+
+    explicit Extraction(const std::shared_ptr<ExtractQueue> &queue) : m_Queue(queue) {}
+
+  private:
+
+    std::shared_ptr<ExtractQueue> m_Queue;
+
+  };
+
 private:
 
   static const unsigned int FLAG_HASDIRNAMES       = 0x00000001;
@@ -71,6 +139,10 @@ private:
   static const unsigned int FLAG_DEFAULTCOMPRESSED = 0x00000004;
   static const unsigned int FLAG_NAMEPREFIXED      = 0x00000100; // if set, the full file name is prefixed before a data block
 
+  static const unsigned int HEADER_SIZE        = 0x24;
+  static const unsigned int FOLDER_RECORD_SIZE = 0x10;
+  static const unsigned int FILE_RECORD_SIZE   = 0x10;
+
 public:
   /**
    * constructor
@@ -80,11 +152,82 @@ public:
   /**
    * read the archive from file
    * @param fileName name of the file to read from
-   * @param testHashes if true, the hashes of file names will be checked to ensure the file is valid.
-   *                    This can be skipped for performance reasons
+   * @param testHashes if true, the hashes of file names will be checked to ensure the file is valid
+   *                   (see verifyHashes). This can be skipped for performance reasons
+   * @param memoryMapped if true, the archive is mapped into memory and all
+   *                     reads are served from the mapped view instead of
+   *                     through a file stream
+   * @param lazyFileNames if true, file names are not read until they are
+   *                      needed (see resolveFileNames). Hashes, sizes and
+   *                      offsets in the index are available right away.
+   *                      Ignored if testHashes is set
    * @return ERROR_NONE on success or an error code
    */
-  EErrorCode read(const char *fileName, bool testHashes);
+  EErrorCode read(const char *fileName, bool testHashes, bool memoryMapped = false,
+                  bool lazyFileNames = false);
+  /**
+   * read the file names if the archive was opened with lazyFileNames. This
+   * happens automatically when the folder tree is built or files are
+   * extracted. Until then all file names in the index are empty
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode resolveFileNames();
+  /**
+   * compare the hashes of all file names with those stored in the archive.
+   * The check is split among the threads set with setVerifyThreadCount.
+   * read does this if testHashes is set
+   * @return indices (see getIndex) of all files whose name doesn't match its
+   *         hash. Empty if the archive is valid
+   */
+  const std::vector<BSAULong> &verifyHashes();
+  /**
+   * @return result of the last hash verification
+   */
+  const std::vector<BSAULong> &getHashMismatches() const { return m_HashMismatches; }
+  /**
+   * set the number of threads used to verify hashes
+   * @param count number of threads. 0 (default) uses one thread per processor core
+   */
+  void setVerifyThreadCount(unsigned int count) { m_VerifyThreadCount = count; }
+  /**
+   * set the number of threads that decompress and write files in extractAll.
+   * The archive itself is always read by a single thread
+   * @param count number of threads. 0 (default) uses one thread per processor core
+   */
+  void setExtractThreadCount(unsigned int count) { m_ExtractThreadCount = count; }
+  /**
+   * set the amount of memory extractAll may use for file data that has been
+   * read but not written yet. Files that need more than a quarter of the
+   * budget are streamed individually
+   * @param bytes the budget in bytes. The default is 128MB
+   */
+  void setExtractMemoryBudget(size_t bytes) { m_ExtractMemoryBudget = bytes; }
+  /**
+   * read the archive through io_uring during extractions, keeping many reads
+   * in flight instead of reading one file after the other. Only available on
+   * Linux. If io_uring isn't supported by the system (or the archive is
+   * memory-mapped) the regular reads are used
+   * @param enable true to use io_uring where available. Disabled by default
+   */
+  void setExtractIoRing(bool enable) { m_ExtractIoRing = enable; }
+  /**
+   * decompress larger files straight into a memory mapping of the output
+   * file instead of writing them through a buffer. The output file is
+   * allocated at its full size before decompressing. Applies to extract and
+   * the extraction functions
+   * @param enable true to map output files. Disabled by default
+   */
+  void setExtractMappedOutput(bool enable) { m_ExtractMappedOutput = enable; }
+  /**
+   * enable caching of the archive index. Once the file names of an archive
+   * have been read, its index is saved to the cache directory and loaded from
+   * there by subsequent calls to read, skipping the parsing of the archive
+   * directory. Cache entries are keyed by the path, size and modification
+   * time of the archive and are only used if the archive header still matches
+   * @param directory directory to store the cache files in. It has to exist.
+   *                  If empty (default) the cache is disabled
+   */
+  void setIndexCacheDirectory(const std::string &directory) { m_IndexCacheDirectory = directory; }
   /**
    * write the archive to disc
    * @param fileName name of the file to write to
@@ -105,18 +248,69 @@ public:
    */
   EType getType() const { return m_Type; }
   /**
-   * retrieve top-level folder
+   * retrieve top-level folder. For an archive read from disc the folder tree
+   * is built from the index on the first call
    * @return descriptor of the root folder
    */
-  Folder::Ptr getRoot() { return m_RootFolder; }
+  Folder::Ptr getRoot();
+  /**
+   * @return compact index of the folders and files read from disc. Unlike
+   *         getRoot this doesn't require the folder tree to be built
+   */
+  const ArchiveIndex &getIndex() const { return m_Index; }
+  /**
+   * look up a file read from disc by its path. Only the hashes of the path
+   * are compared, the folder tree is built if necessary
+   * @param path path of the file within the archive, i.e.
+   *             "meshes\\clutter\\bucket01.nif". Case and type of slashes don't matter
+   * @return descriptor of the file or a null pointer if it's not in the archive
+   */
+  File::Ptr findFile(const std::string &path);
+  /**
+   * look up a folder read from disc by its path. Only folders stored in the
+   * archive (those that contain files) can be found
+   * @param path path of the folder within the archive, i.e. "meshes\\clutter"
+   * @return descriptor of the folder or a null pointer if it's not in the archive
+   */
+  Folder::Ptr findFolder(const std::string &path);
   /**
-   * extract a file from the archive
+   * extract a file from the archive. File data is read at explicit offsets,
+   * so extract, getUncompressedSize and readFile may be called from several
+   * threads at once, also while an extraction is running
    * @param file descriptor of the file to extract
    * @param outputDirectory name of the directory to extract to.
    *                        may be absolute or relative
    * @return ERROR_NONE on success or an error code
    */
   EErrorCode extract(File::Ptr file, const char *outputDirectory) const;
+  /**
+   * determine the size of a file once extracted. For compressed files this
+   * reads the original size stored with the file data
+   * @param file descriptor of the file
+   * @param size receives the size of the file
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode getUncompressedSize(File::Ptr file, BSAULong &size) const;
+  /**
+   * read the content of a file into memory, decompressing it if necessary.
+   * Nothing is written to disk
+   * @param file descriptor of the file to read
+   * @param buffer receives the content of the file
+   * @param bufferSize size of the buffer
+   * @param size receives the size of the file, also if the buffer is too small
+   * @return ERROR_NONE on success, ERROR_BUFFERTOOSMALL if the buffer can't
+   *         hold the file or another error code
+   */
+  EErrorCode readFile(File::Ptr file, unsigned char *buffer, BSAULong bufferSize,
+                      BSAULong &size) const;
+  /**
+   * read the content of a file into a newly allocated buffer
+   * @param file descriptor of the file to read
+   * @param data receives the buffer and the size of the file. The buffer
+   *             remains valid after the archive is closed
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode readFile(File::Ptr file, DataBuffer &data) const;
 
   /**
    * extract all files. this is potentially faster than iterating over all files and
@@ -124,12 +318,78 @@ public:
    * @param outputDirectory name of the directory to extract to.
    *                        may be absolute or relative
    * @param progress callback function called on progress
-   * @param overwrite if true (default) files are overwritten if they exist
+   * @param overwrite if true (default) files are overwritten if they exist.
+   *                  Otherwise the output folders are scanned up front and
+   *                  files that exist aren't read from the archive at all
    * @return ERROR_NONE on success or an error code
    */
   EErrorCode extractAll(const char *outputDirectory,
                         const boost::function<bool (int value, std::string fileName)> &progress,
                         bool overwrite = true);
+  /**
+   * extract a selection of files. The files are read in the order of their
+   * data in the archive and are written by the same workers as in extractAll.
+   * Only the directories containing selected files are created
+   * @param files the files to extract. All of them have to be part of this archive
+   * @param outputDirectory name of the directory to extract to.
+   *                        may be absolute or relative
+   * @param progress callback function called on progress
+   * @param overwrite if true (default) files are overwritten if they exist.
+   *                  Existing files are skipped without being read otherwise
+   * @return ERROR_NONE on success, ERROR_FILENOTFOUND if a file isn't part of
+   *         this archive (nothing is extracted in that case) or another error code
+   */
+  EErrorCode extractFiles(const std::vector<File::Ptr> &files, const char *outputDirectory,
+                          const boost::function<bool (int value, std::string fileName)> &progress,
+                          bool overwrite = true);
+  /**
+   * extract all files for which a filter returns true. Otherwise the same as
+   * the list variant
+   * @param filter called with the path of each file within the archive,
+   *               i.e. "meshes\\clutter\\bucket01.nif"
+   */
+  EErrorCode extractFiles(const boost::function<bool (const std::string &path)> &filter,
+                          const char *outputDirectory,
+                          const boost::function<bool (int value, std::string fileName)> &progress,
+                          bool overwrite = true);
+
+  /**
+   * start extracting all files in the background. Directories are created
+   * before this returns, the files are extracted by the same threads as in
+   * extractAll
+   * @param outputDirectory name of the directory to extract to.
+   *                        may be absolute or relative
+   * @param overwrite if true (default) files are overwritten if they exist.
+   *                  Existing files are skipped without being read otherwise
+   * @param fileDone called after each file, from the extraction threads and
+   *                 possibly from several at once. Not called for files
+   *                 skipped after cancellation. May be empty
+   * @param finished called once the extraction has finished, from the last
+   *                 extraction thread or from the calling thread if the
+   *                 extraction couldn't be started. May be empty
+   * @return handle to the extraction
+   * @note the archive has to stay open until the extraction has finished
+   */
+  Extraction::Ptr extractAllAsync(const char *outputDirectory, bool overwrite = true,
+                                  const FileCallback &fileDone = FileCallback(),
+                                  const FinishedCallback &finished = FinishedCallback());
+  /**
+   * start extracting a selection of files in the background, see extractFiles
+   * and extractAllAsync. If a file isn't part of this archive, the
+   * extraction finishes with ERROR_FILENOTFOUND without extracting anything
+   */
+  Extraction::Ptr extractFilesAsync(const std::vector<File::Ptr> &files,
+                                    const char *outputDirectory, bool overwrite = true,
+                                    const FileCallback &fileDone = FileCallback(),
+                                    const FinishedCallback &finished = FinishedCallback());
+  /**
+   * start extracting all files for which a filter returns true in the
+   * background, see extractFiles and extractAllAsync
+   */
+  Extraction::Ptr extractFilesAsync(const boost::function<bool (const std::string &path)> &filter,
+                                    const char *outputDirectory, bool overwrite = true,
+                                    const FileCallback &fileDone = FileCallback(),
+                                    const FinishedCallback &finished = FinishedCallback());
 
   /**
    * @param file the file to check
@@ -161,29 +421,85 @@ private:
     BSAULong fileFlags;
   };
 
+  // identifies the archive an index cache entry was created from
+  struct IndexCacheKey {
+    std::string fileName;
+    unsigned long long fileSize;
+    unsigned long long modifiedTime;
+    char header[HEADER_SIZE];
+  };
+
   struct FileInfo {
-    File::Ptr file;
+    BSAULong file; // index entry
     DataBuffer data;
+    size_t memory; // bytes of the extraction memory budget used by the file
+    bool copy; // not read into memory, the worker copies it with copyUncompressed
   };
 
 
+
 private:
 
-  static Header readHeader(std::fstream &infile);
+  static Header readHeader(const char *&data, const char *end);
 
   static EType typeFromID(BSAULong typeID);
 
-  static boost::shared_array<unsigned char> decompress(unsigned char *inBuffer, BSAULong inSize, EErrorCode &result, BSAULong &outSize);
-
 
   BSAULong typeToID(EType type);
 
-  Folder readFolderRecord(std::fstream &file);
+  /**
+   * load the remaining directory of the archive (everything up to the file
+   * data) into memory with a single read
+   * @param header the already parsed header
+   * @param directory buffer containing the header. The rest of the directory
+   *                  is appended
+   * @param includeFileNames if false, the file name list at the end of the
+   *                         directory is skipped
+   * @return ERROR_INVALIDDATA if the records listed in the header don't fit
+   *         into the archive
+   */
+  EErrorCode readDirectory(const Header &header, std::vector<char> &directory,
+                           bool includeFileNames);
 
-//  EErrorCode extractDirect(const File &fileInfo, std::ofstream &outFile);
-//  EErrorCode extractCompressed(const File &fileInfo, std::ofstream &outFile);
+  /**
+   * @return name of the cache file for the current archive
+   */
+  std::string indexCacheFile() const;
+  /**
+   * load the index from the cache if there is an up-to-date entry
+   * @param hashesTested if true, only an entry whose file name hashes were
+   *                     tested when it was created is accepted
+   * @return true if the index was loaded
+   */
+  bool loadIndexCache(bool hashesTested);
+  /**
+   * save the index to the cache. Failure to write the cache is ignored
+   * @param hashesTested true if the file name hashes have been tested
+   */
+  void saveIndexCache(bool hashesTested) const;
+
+  bool mapped() const { return m_MappedData != nullptr; }
+
+  /**
+   * locate the data blob of a file inside the mapped archive
+   * @param offset offset of the file data
+   * @param size size of the file data. Receives the size of the blob, excluding the name prefix
+   * @return pointer to the blob or nullptr if the record points outside the archive
+   */
+  const char *mappedData(BSAULong offset, BSAULong &size) const;
+
+  /**
+   * build the folder tree from the index
+   */
+  void buildTree();
+
+  /**
+   * @return full path of a file of the index within the archive
+   */
+  std::string filePath(BSAULong file) const;
 
   bool defaultCompressed() const { return (m_ArchiveFlags & FLAG_DEFAULTCOMPRESSED) != 0; }
+  bool compressed(bool compressToggled) const { return defaultCompressed() != compressToggled; }
   // starting with FO3 the bsa may prefix the file name to the file blob if archive flag 0x100 is set
   bool namePrefixed() const { return (m_Type != TYPE_OBLIVION) && ((m_ArchiveFlags & FLAG_NAMEPREFIXED) != 0); }
 
@@ -198,29 +514,226 @@ private:
   void writeHeader(std::fstream &outfile, BSAULong fileFlags, BSAULong numFolders,
                    BSAULong folderNamesLength, BSAULong fileNamesLength);
 
-  EErrorCode extractDirect(File::Ptr file, std::ofstream &outFile) const;
-  EErrorCode extractCompressed(File::Ptr file, std::ofstream &outFile) const;
+  EErrorCode extractDirect(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const;
+  EErrorCode extractCompressed(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const;
+  /**
+   * extract a file into an opened output file, which is closed afterwards
+   * @param dataOffset offset of the file data, including the name prefix
+   * @param size size of the file data, including the name prefix
+   * @param isCompressed true if the file data is compressed
+   * @param outFile the output file
+   */
+  EErrorCode extractData(BSAULong dataOffset, BSAULong size, bool isCompressed,
+                         OutputFile &outFile) const;
+
+  /**
+   * @return true if a file of the specified size is decompressed into a
+   *         mapping of the output file
+   */
+  bool mapOutput(BSAULong size) const;
+
+  /**
+   * @return true if uncompressed files are extracted with copyUncompressed
+   *         instead of being read into memory and written back
+   */
+  bool directCopy() const;
+  /**
+   * extract an uncompressed file by copying its data straight from the
+   * archive to the output file, inside the kernel where possible
+   * @param dataOffset offset of the file data, including the name prefix
+   * @param size size of the file data, including the name prefix
+   * @param outFile the output file
+   */
+  EErrorCode copyUncompressed(BSAULong dataOffset, BSAULong size, OutputFile &outFile) const;
+
+  /**
+   * skip the file name that may be prefixed to the data of a file. Reads
+   * through the positional handle, so this is safe to call concurrently
+   * @param offset offset of the file data. Advanced past the prefix
+   * @param size size of the file data. Reduced by the length of the prefix
+   * @return false if the prefix can't be read or is longer than the data
+   */
+  bool skipNamePrefix(BSAULong &offset, BSAULong &size) const;
+
+  /**
+   * find the data of a file and determine its size once extracted
+   * @param data receives the start of the data if the archive is mapped
+   * @param dataOffset receives the offset of the data in the archive, past the
+   *                   name prefix and the original size of compressed files
+   * @param inSize receives the size of the data
+   * @param outSize receives the size after decompression
+   */
+  EErrorCode locateFileData(const File &file, const unsigned char *&data,
+                            BSAULong &dataOffset, BSAULong &inSize, BSAULong &outSize) const;
+  /**
+   * read the data found by locateFileData into a buffer of outSize bytes,
+   * decompressing it if necessary
+   */
+  EErrorCode readFileData(const File &file, const unsigned char *data, BSAULong dataOffset,
+                          BSAULong inSize, unsigned char *buffer, BSAULong outSize) const;
 
+  /**
+   * decompress a zlib stream in chunks, writing each chunk as soon as it is
+   * decompressed. Memory use doesn't depend on the size of the file
+   * @param inBuffer the compressed data or nullptr to read it from the archive
+   * @param inOffset offset of the compressed data in the archive if inBuffer is nullptr
+   * @param inSize size of the compressed data
+   * @param outSize size of the decompressed data as stored in the archive. If
+   *                the stream ends early the output is padded with zeros
+   * @param outFile file to write the decompressed data to or nullptr to use outBuffer
+   * @param outBuffer receives the decompressed data if outFile is nullptr.
+   *                  Has to hold outSize bytes
+   */
+  EErrorCode inflateStream(const unsigned char *inBuffer, BSAULong inOffset,
+                           BSAULong inSize, BSAULong outSize,
+                           OutputFile *outFile, unsigned char *outBuffer) const;
 
-  void createFolders(const std::string &targetDirectory, Folder::Ptr folder);
+  /**
+   * open the output file of a file of an extraction, relative to its folder
+   * in the output tree
+   * @return ERROR_NONE on success. If the file exists and may not be
+   *         overwritten, outFile is left closed
+   */
+  EErrorCode openOutputFile(const ExtractQueue &queue, BSAULong file, OutputFile &outFile) const;
+  /**
+   * write a file read by the reader of extractAll
+   */
+  EErrorCode writeFile(const FileInfo &fileInfo, const ExtractQueue &queue) const;
 
-  void readFiles(std::queue<FileInfo> &queue,
-                 boost::mutex &mutex,
-                 boost::interprocess::interprocess_semaphore &bufferCount,
-                 boost::interprocess::interprocess_semaphore &queueFree,
-                 std::vector<File::Ptr>::iterator begin,
-                 std::vector<File::Ptr>::iterator end);
 
-  void extractFiles(const std::string &targetDirectory,
-                    std::queue<FileInfo> &queue, boost::mutex &mutex,
-                    boost::interprocess::interprocess_semaphore &bufferCount,
-                    boost::interprocess::interprocess_semaphore &queueFree,
-                    int totalFiles, bool overwrite, int &filesDone);
+  /**
+   * create the specified folders of the index (including all parent
+   * directories) in the target directory and set up the output tree of an
+   * extraction
+   * @param folders the folders in ascending order. The list is taken over
+   *                by the extraction
+   * @return false if the target directory can't be created or opened
+   */
+  bool createFolders(ExtractQueue &queue, const std::string &targetDirectory,
+                     std::vector<BSAULong> &folders);
+  /**
+   * move the files of an extraction that exist in the output tree from the
+   * file list to the skipped files, scanning each output folder once
+   * @note the file list has to be in index order
+   */
+  void skipExistingFiles(ExtractQueue &queue) const;
+
+  /**
+   * start the reader and the workers of an extraction
+   * @param fileList index entries of the files to extract. The list is
+   *                 taken over by the extraction
+   * @param folders folders containing the files, in ascending order. The
+   *                list is taken over by the extraction as well
+   */
+  Extraction::Ptr startExtraction(std::vector<BSAULong> &fileList, std::vector<BSAULong> &folders,
+                                  const std::string &targetDirectory,
+                                  bool overwrite, const FileCallback &fileDone,
+                                  const FinishedCallback &finished);
+  /**
+   * @return an extraction that has already finished with the specified error
+   */
+  static Extraction::Ptr failedExtraction(EErrorCode result, const FinishedCallback &finished);
+  /**
+   * wait for an extraction to finish, calling the progress callback whenever
+   * the percentage of files done changes. The extraction is canceled if the
+   * callback returns false
+   */
+  EErrorCode waitForExtraction(const Extraction::Ptr &extraction,
+                               const boost::function<bool (int value, std::string fileName)> &progress) const;
+
+  /**
+   * read the data of the files of an extraction in sequence and queue it
+   * for the extraction workers. Files too large for the memory budget are
+   * extracted right away, streaming their data. Once done (or canceled),
+   * each worker is woken up once more with an empty queue to signal the end
+   */
+  void readFiles(std::shared_ptr<ExtractQueue> queue, unsigned int workerCount);
+  /**
+   * read the files of an extraction one after the other. Runs of files that
+   * are adjacent in the archive are read with a single request
+   */
+  void readFilesSequential(ExtractQueue &queue);
+  /**
+   * read a single file of an extraction and queue it
+   */
+  void queueFile(ExtractQueue &queue, BSAULong file);
+  /**
+   * find the run of files starting at begin that can be read with a single
+   * request: files stored one after another (allowing for small gaps) that
+   * together don't exceed COALESCE_SIZE
+   * @return end of the run. begin + 1 if the file can't be combined with the next
+   */
+  std::vector<BSAULong>::const_iterator findAdjacentFiles(
+      const ExtractQueue &queue, std::vector<BSAULong>::const_iterator begin) const;
+  /**
+   * read a run of files found by findAdjacentFiles into one buffer and queue
+   * each file with a view into that buffer
+   */
+  void readAdjacentFiles(ExtractQueue &queue, std::vector<BSAULong>::const_iterator begin,
+                         std::vector<BSAULong>::const_iterator end);
+  /**
+   * strip the name prefix from file data read into memory and check that
+   * compressed files are large enough to hold their original size
+   * @return false if the data is invalid
+   */
+  bool trimFileData(FileInfo &fileInfo) const;
+  /**
+   * extract a file that's too large to be queued from the reader
+   */
+  EErrorCode extractLargeFile(const ExtractQueue &queue, BSAULong file) const;
+#ifdef BSA_HAVE_IO_URING
+  /**
+   * read the files of an extraction with up to IORING_DEPTH reads in flight
+   * @return false if io_uring can't be used. Nothing has been read in that case
+   */
+  bool readFilesIoRing(ExtractQueue &queue);
+  /**
+   * submit the queued reads, wait for at least one to complete and pass all
+   * completed files on to the workers
+   */
+  void completeReads(ExtractQueue &queue, IoRing &ring,
+                     std::vector<FileInfo> &reading, std::vector<unsigned int> &freeSlots);
+  /**
+   * check a completed read, strip the name prefix and queue the file
+   * @param result result of the read request. Short or failed reads are
+   *               completed synchronously
+   */
+  void finishRead(ExtractQueue &queue, FileInfo &fileInfo, int result);
+#endif // BSA_HAVE_IO_URING
+
+  /**
+   * extraction worker, decompresses and writes queued files until the queue
+   * runs empty
+   */
+  void writeQueuedFiles(std::shared_ptr<ExtractQueue> queue);
 private:
 
+  // used to parse the directory and to write archives
   mutable std::fstream m_File;
-
+  // file data is read at explicit offsets so extractions don't share a file position
+  std::unique_ptr<PositionalFile> m_DataFile;
+
+  std::unique_ptr<boost::interprocess::file_mapping> m_Mapping;
+  std::unique_ptr<boost::interprocess::mapped_region> m_MappedRegion;
+  const char *m_MappedData;
+  size_t m_MappedSize;
+
+  ArchiveIndex m_Index;
+  // recycles read and decompression buffers between files
+  std::unique_ptr<BufferPool> m_BufferPool;
+  std::string m_IndexCacheDirectory;
+  // empty file name if the cache isn't used for the current archive
+  IndexCacheKey m_IndexCacheKey;
+  unsigned int m_VerifyThreadCount;
+  unsigned int m_ExtractThreadCount;
+  size_t m_ExtractMemoryBudget;
+  bool m_ExtractIoRing;
+  bool m_ExtractMappedOutput;
+  std::vector<BSAULong> m_HashMismatches;
   Folder::Ptr m_RootFolder;
+  // tree nodes of the index entries, only valid once the tree is built
+  std::vector<Folder::Ptr> m_FolderViews;
+  std::vector<File::Ptr> m_FileViews;
 
   BSAULong m_ArchiveFlags;
   EType m_Type;
@@ -0,0 +1,86 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsabufferpool.h"
+
+
+namespace BSA {
+
+
+BufferPool::BufferPool(size_t maxFreeBytes)
+  : m_FreeBytes(0), m_MaxFreeBytes(maxFreeBytes)
+{
+}
+
+
+BufferPool::~BufferPool()
+{
+  for (unsigned int i = 0; i < NUM_SIZECLASSES; ++i) {
+    for (std::vector<unsigned char*>::const_iterator iter = m_Free[i].begin();
+         iter != m_Free[i].end(); ++iter) {
+      delete [] *iter;
+    }
+  }
+}
+
+
+boost::shared_array<unsigned char> BufferPool::get(size_t size)
+{
+  unsigned int sizeClass = 0;
+  while ((sizeClass < NUM_SIZECLASSES) && (classSize(sizeClass) < size)) {
+    ++sizeClass;
+  }
+
+  if (sizeClass == NUM_SIZECLASSES) {
+    return boost::shared_array<unsigned char>(new unsigned char[size]);
+  }
+
+  unsigned char *buffer = nullptr;
+  {
+    boost::mutex::scoped_lock lock(m_Mutex);
+    if (!m_Free[sizeClass].empty()) {
+      buffer = m_Free[sizeClass].back();
+      m_Free[sizeClass].pop_back();
+      m_FreeBytes -= classSize(sizeClass);
+    }
+  }
+  if (buffer == nullptr) {
+    buffer = new unsigned char[classSize(sizeClass)];
+  }
+  return boost::shared_array<unsigned char>(buffer, Release(this, sizeClass));
+}
+
+
+void BufferPool::release(unsigned char *buffer, unsigned int sizeClass)
+{
+  {
+    boost::mutex::scoped_lock lock(m_Mutex);
+    if (m_FreeBytes + classSize(sizeClass) <= m_MaxFreeBytes) {
+      m_Free[sizeClass].push_back(buffer);
+      m_FreeBytes += classSize(sizeClass);
+      return;
+    }
+  }
+  delete [] buffer;
+}
+
+
+} // namespace BSA
@@ -0,0 +1,102 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#ifndef BSABUFFERPOOL_H
+#define BSABUFFERPOOL_H
+
+
+#include <vector>
+#include <cstddef>
+#ifndef Q_MOC_RUN
+#include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
+#endif // Q_MOC_RUN
+
+
+namespace BSA {
+
+
+/**
+ * @brief thread-safe pool of byte buffers. Buffers are grouped in
+ * power-of-two size classes and return to the pool once the last reference
+ * to them is released, so they can be reused for the next file
+ */
+class BufferPool {
+
+public:
+
+  /**
+   * constructor
+   * @param maxFreeBytes maximum total size of the unused buffers kept in the
+   *                     pool. Buffers released beyond that are freed
+   */
+  explicit BufferPool(size_t maxFreeBytes);
+  ~BufferPool();
+
+  /**
+   * @param size minimum size of the buffer
+   * @return a buffer of at least the requested size. The content is undefined.
+   * @note the pool has to outlive all buffers it handed out
+   */
+  boost::shared_array<unsigned char> get(size_t size);
+
+private:
+
+  // smallest buffer handed out
+  static const size_t MIN_SIZE = 4096;
+  // buffers larger than the biggest size class aren't pooled
+  static const unsigned int NUM_SIZECLASSES = 16;
+
+  class Release {
+  public:
+    Release(BufferPool *pool, unsigned int sizeClass) : m_Pool(pool), m_SizeClass(sizeClass) {}
+    void operator()(unsigned char *buffer) const { m_Pool->release(buffer, m_SizeClass); }
+  private:
+    BufferPool *m_Pool;
+    unsigned int m_SizeClass;
+  };
+
+private:
+
+  // copy constructor not implemented
+  BufferPool(const BufferPool &reference);
+
+  // assignment operator not implemented
+  BufferPool &operator=(const BufferPool &reference);
+
+  static size_t classSize(unsigned int sizeClass) { return MIN_SIZE << sizeClass; }
+
+  void release(unsigned char *buffer, unsigned int sizeClass);
+
+private:
+
+  boost::mutex m_Mutex;
+  std::vector<unsigned char*> m_Free[NUM_SIZECLASSES];
+  size_t m_FreeBytes;
+  size_t m_MaxFreeBytes;
+
+};
+
+
+} // namespace BSA
+
+#endif // BSABUFFERPOOL_H
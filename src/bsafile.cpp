@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "bsaexception.h"
 #include "filehash.h"
 #include "bsafolder.h"
+#include "bsaindex.h"
 #include <climits>
 #include <cstring>
 #include <stdexcept>
@@ -46,35 +47,27 @@ bool ByOffset(const File::Ptr &LHS, const File::Ptr &RHS)
 static const unsigned long CHUNK_SIZE = 128 * 1024;
 
 
-File::File(std::fstream &file, Folder *folder)
-  : m_Folder(folder), m_New(false), m_ToggleCompressed(false)
+File::File(Folder *folder, const std::string &name, BSAHash nameHash,
+           BSAULong fileSize, BSAULong dataOffset, bool toggleCompressed,
+           BSAULong indexEntry)
+  : m_Folder(folder), m_New(false), m_NameHash(nameHash), m_Name(name),
+    m_FileSize(fileSize), m_DataOffset(dataOffset),
+    m_ToggleCompressed(toggleCompressed), m_IndexEntry(indexEntry)
 {
-  m_NameHash = readType<BSAHash>(file);
-  m_FileSize = readType<BSAULong>(file);
-  m_DataOffset = readType<BSAULong>(file);
-  if ((m_FileSize & (1 << 30)) != 0) {
-    m_ToggleCompressed = true;
-    m_FileSize ^= (1 << 30);
-  }
 }
 
 
 File::File(const std::string &name, const std::string &sourceFile,
            Folder *folder, bool toggleCompressed)
   : m_Folder(folder), m_New(true), m_Name(name),
-    m_ToggleCompressed(toggleCompressed), m_SourceFile(sourceFile),
+    m_ToggleCompressed(toggleCompressed), m_IndexEntry(ArchiveIndex::NOT_FOUND),
+    m_SourceFile(sourceFile),
     m_ToggleCompressedWrite(toggleCompressed)
 {
   m_NameHash = calculateBSAHash(name);
 }
 
 
-std::string File::getFilePath() const
-{
-  return m_Folder->getFullPath() + "\\" + m_Name;
-}
-
-
 void File::writeHeader(fstream &file) const
 {
   writeType<BSAHash>(file, m_NameHash);
@@ -87,17 +80,29 @@ void File::writeHeader(fstream &file) const
 }
 
 
-EErrorCode File::writeData(fstream &sourceArchive,
-                           fstream &targetArchive) const
+EErrorCode File::writeData(fstream &sourceArchive, const char *sourceMapping,
+                           size_t sourceMappingSize, fstream &targetArchive) const
 {
   m_DataOffsetWrite = static_cast<BSAULong>(targetArchive.tellp());
   EErrorCode result = ERROR_NONE;
 
   std::unique_ptr<char[]> inBuffer(new char[CHUNK_SIZE]);
 
-  if (m_SourceFile.length() == 0) {
+  if ((m_SourceFile.length() == 0) && (sourceMapping != nullptr)) {
+    // copy straight from the mapped source archive
+    if ((m_DataOffset > sourceMappingSize)
+        || (m_FileSize > sourceMappingSize - m_DataOffset)) {
+      return ERROR_INVALIDDATA;
+    }
+    try {
+      targetArchive.write(sourceMapping + m_DataOffset, m_FileSize);
+    } catch (const std::exception&) {
+      result = ERROR_INVALIDDATA;
+    }
+  } else if (m_SourceFile.length() == 0) {
     // copy from source archive
 #pragma message("we may have to compress/decompress!")
+    sourceArchive.clear();
     sourceArchive.seekg(m_DataOffset, fstream::beg);
 
     try {
@@ -133,16 +138,4 @@ EErrorCode File::writeData(fstream &sourceArchive,
   return result;
 }
 
-
-void File::readFileName(fstream &file, bool testHashes)
-{
-  m_Name = readZString(file);
-  if (testHashes) {
-    if (calculateBSAHash(m_Name) != m_NameHash) {
-      throw data_invalid_exception(makeString("invalid name hash for \"%s\" (%lx vs %lx)",
-        m_Name.c_str(), calculateBSAHash(m_Name), m_NameHash));
-    }
-  }
-}
-
 }
@@ -51,9 +51,10 @@ public:
    */
   const std::string &getName() const { return m_Name; }
   /**
-   * @return full path of this file within the archive
+   * @return full path of this file within the archive. Empty if the file
+   *         hasn't been added to a folder
    */
-  std::string getFilePath() const;
+  const std::string &getFilePath() const { return m_FilePath; }
   /**
    * @return size of the file. If the source is an archive and the file is
    *         compressed, this returns the compressed size!
@@ -69,11 +70,19 @@ private:
   File& operator=(const File& reference);
 
   /**
-   * construct file from source archive
-   * @param file a file read from
+   * construct file from an entry of the source archive
    * @param folder the folder to add the file to
+   * @param name the base name of the file
+   * @param nameHash hash of the name as stored in the archive
+   * @param fileSize size of the file data in the archive
+   * @param dataOffset offset of the file data in the archive
+   * @param toggleCompressed true if the compression of the file differs
+   *                         from the archive default
+   * @param indexEntry position of the file in the archive index
    */
-  File(std::fstream &file, Folder *folder);
+  File(Folder *folder, const std::string &name, BSAHash nameHash,
+       BSAULong fileSize, BSAULong dataOffset, bool toggleCompressed,
+       BSAULong indexEntry);
 
   /**
    * construct from loose file
@@ -96,11 +105,11 @@ private:
    */
   BSAULong getDataOffset() const { return m_DataOffset; }
   void writeHeader(std::fstream &file) const;
-  EErrorCode writeData(std::fstream &sourceArchive, std::fstream &targetArchive) const;
+  EErrorCode writeData(std::fstream &sourceArchive, const char *sourceMapping,
+                       size_t sourceMappingSize, std::fstream &targetArchive) const;
 
   void setFileSize(BSAULong fileSize) { m_FileSize = fileSize; }
 
-  void readFileName(std::fstream &file, bool testHashes);
 
 private:
 
@@ -109,9 +118,13 @@ private:
 
   BSAHash m_NameHash;
   std::string m_Name;
+  // maintained by the folder containing the file
+  std::string m_FilePath;
   mutable BSAULong m_FileSize;
   BSAULong m_DataOffset;
   bool m_ToggleCompressed;
+  // ArchiveIndex::NOT_FOUND for loose files
+  BSAULong m_IndexEntry;
 
   std::string m_SourceFile;
   bool m_ToggleCompressedWrite;
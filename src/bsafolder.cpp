@@ -24,6 +24,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "bsafile.h"
 #include "bsaarchive.h"
 #include "bsaexception.h"
+#include "filehash.h"
+#include <cctype>
 
 
 using std::fstream;
@@ -32,38 +34,9 @@ namespace BSA {
 
 
 Folder::Folder()
-  : m_Parent(nullptr), m_Name()
+  : m_Parent(nullptr), m_Name(), m_FullPath(), m_FileCount(0)
 {
   m_NameHash = calculateBSAHash(m_Name);
-  m_FileCount = 0;
-  m_Offset = ULONG_MAX;
-}
-
-
-Folder::Ptr Folder::readFolder(std::fstream &file, BSAULong fileNamesLength,
-                               BSAULong &endPos)
-{
-  Folder::Ptr result(new Folder());
-  result->m_NameHash = readType<BSAHash>(file);
-  result->m_FileCount = readType<unsigned long>(file);
-  result->m_Offset = readType<unsigned long>(file);
-  std::streamoff pos = file.tellg();
-
-  file.seekg(result->m_Offset - fileNamesLength, fstream::beg);
-
-  result->m_Name = readBString(file);
-
-  for (unsigned long i = 0UL; i < result->m_FileCount; ++i) {
-    result->m_Files.push_back(File::Ptr(new File(file, result.get())));
-  }
-
-  if (static_cast<unsigned long>(file.tellg()) > endPos) {
-    endPos = static_cast<BSAULong>(file.tellg());
-  }
-
-  file.seekg(pos);
-
-  return result;
 }
 
 
@@ -87,11 +60,14 @@ void Folder::writeData(std::fstream &file, BSAULong fileNamesLength) const
 
 
 EErrorCode Folder::writeFileData(std::fstream &sourceFile,
+                                 const char *sourceMapping,
+                                 size_t sourceMappingSize,
                                  std::fstream &targetFile) const
 {
   for (std::vector<File::Ptr>::const_iterator iter = m_Files.begin();
        iter != m_Files.end(); ++iter) {
-    EErrorCode error = (*iter)->writeData(sourceFile, targetFile);
+    EErrorCode error = (*iter)->writeData(sourceFile, sourceMapping,
+                                          sourceMappingSize, targetFile);
     if (error != ERROR_NONE) {
       return error;
     }
@@ -100,95 +76,114 @@ EErrorCode Folder::writeFileData(std::fstream &sourceFile,
 }
 
 
-std::string Folder::getFullPath() const
+void Folder::updateFullPath()
 {
   if (m_Parent != nullptr) {
-    std::string temp = m_Parent->getFullPath();
-    if (temp.length() != 0) {
-      return temp.append("\\").append(m_Name);
+    if (m_Parent->m_FullPath.length() != 0) {
+      m_FullPath = m_Parent->m_FullPath + "\\" + m_Name;
     } else {
-      return m_Name;
+      m_FullPath = m_Name;
     }
   } else {
     // root folder shouldn't have a name
-    return std::string();
+    m_FullPath.clear();
+  }
+
+  for (std::vector<File::Ptr>::const_iterator iter = m_Files.begin();
+       iter != m_Files.end(); ++iter) {
+    (*iter)->m_FilePath = m_FullPath + "\\" + (*iter)->m_Name;
+  }
+  for (std::vector<Folder::Ptr>::const_iterator iter = m_SubFolders.begin();
+       iter != m_SubFolders.end(); ++iter) {
+    (*iter)->updateFullPath();
+  }
+}
+
+
+void Folder::addFile(const File::Ptr &file)
+{
+  file->m_Folder = this;
+  file->m_FilePath = m_FullPath + "\\" + file->m_Name;
+  m_Files.push_back(file);
+  for (Folder *folder = this; folder != nullptr; folder = folder->m_Parent) {
+    ++folder->m_FileCount;
   }
 }
 
 
 void Folder::addFolderInt(Folder::Ptr folder)
 {
-  for (std::vector<Folder::Ptr>::iterator iter = m_SubFolders.begin();
-       iter != m_SubFolders.end(); ++iter) {
-    // for folder to be a subfolder of iter, the name of iter has to be the
-    // first path component of folders path and there has to be room left for a 
-    // backslash and the name of folder itself
-    size_t nameLength = (*iter)->m_Name.length();
-    if ((folder->m_Name.length() > (*iter)->m_Name.length()) &&
-        (folder->m_Name.compare(0, (*iter)->m_Name.length(), (*iter)->m_Name) == 0) &&
-        ((folder->m_Name[nameLength] == '\\') ||
-         (folder->m_Name[nameLength] == '/'))) {
-      // remove the matched part of the path and recurse
-      folder->m_Name = folder->m_Name.substr((*iter)->m_Name.length() + 1);
-      (*iter)->addFolderInt(folder);
-      return;
+  // walk down the path one component at a time
+  Folder *parent = this;
+  const std::string &path = folder->m_Name;
+  std::string::size_type begin = 0;
+  std::string::size_type end = path.find_first_of("\\/");
+  while (end != std::string::npos) {
+    Folder *child = parent->findSubFolder(path.c_str() + begin, end - begin);
+    if (child == nullptr) {
+      // add dummy folder for the path component
+      Folder::Ptr dummy(new Folder);
+      dummy->m_Name = path.substr(begin, end - begin);
+      parent->addSubFolder(dummy);
+      child = dummy.get();
     }
+    parent = child;
+    begin = end + 1;
+    end = path.find_first_of("\\/", begin);
   }
 
-  // no subfolder matches, create one
-  std::string::size_type pos = folder->m_Name.find_first_of("\\/");
-  if (pos == std::string::npos) {
-    // no more path components, add the new folder right here
-    folder->m_Parent = this;
-    m_SubFolders.push_back(folder);
-  } else {
-    // add dummy folder for the next path component
-    Folder::Ptr dummy(new Folder);
-    dummy->m_Parent = this;
-    dummy->m_Name = folder->m_Name.substr(0, pos);
-    folder->m_Name = folder->m_Name.substr(pos + 1);
-    dummy->addFolderInt(folder);
-    m_SubFolders.push_back(dummy);
-  }
+  // no more path components, add the new folder right here
+  folder->m_Name.erase(0, begin);
+  parent->addSubFolder(folder);
 }
 
 
-Folder::Ptr Folder::addFolder(std::fstream &file, BSAULong fileNamesLength, BSAULong &endPos)
+static bool namesEqual(const std::string &lhs, const char *rhs, size_t rhsLength)
 {
-  Folder::Ptr temp = readFolder(file, fileNamesLength, endPos);
-  addFolderInt(temp);
-
-  return temp;
+  if (lhs.length() != rhsLength) {
+    return false;
+  }
+  for (size_t i = 0; i < rhsLength; ++i) {
+    if (tolower(static_cast<unsigned char>(lhs[i])) != tolower(static_cast<unsigned char>(rhs[i]))) {
+      return false;
+    }
+  }
+  return true;
 }
 
 
-bool Folder::resolveFileNames(std::fstream &file, bool testHashes)
+Folder *Folder::findSubFolder(const char *name, size_t length) const
 {
-  bool hashesValid = true;
-  for (std::vector<File::Ptr>::iterator iter = m_Files.begin();
-       iter != m_Files.end(); ++iter) {
-    try {
-      (*iter)->readFileName(file, testHashes);
-    } catch (const std::exception&) {
-      hashesValid = false;
+  typedef std::unordered_multimap<BSAHash, Folder*>::const_iterator Iter;
+  std::pair<Iter, Iter> range = m_SubFolderMap.equal_range(calculateBSAFolderHash(name, length));
+  for (Iter iter = range.first; iter != range.second; ++iter) {
+    if (namesEqual(iter->second->m_Name, name, length)) {
+      return iter->second;
     }
   }
-  return hashesValid;
+  return nullptr;
 }
 
-const Folder::Ptr Folder::getSubFolder(unsigned int index) const
+
+void Folder::addSubFolder(const Folder::Ptr &folder)
 {
-  return m_SubFolders.at(index);
+  folder->m_Parent = this;
+  folder->updateFullPath();
+  m_SubFolders.push_back(folder);
+  for (Folder *parent = this; parent != nullptr; parent = parent->m_Parent) {
+    parent->m_FileCount += folder->m_FileCount;
+  }
+  // if there are several folders with the same name, lookups find the first one
+  if (findSubFolder(folder->m_Name.c_str(), folder->m_Name.length()) == nullptr) {
+    m_SubFolderMap.insert(std::make_pair(
+        calculateBSAFolderHash(folder->m_Name.c_str(), folder->m_Name.length()), folder.get()));
+  }
 }
 
-unsigned int Folder::countFiles() const
+
+const Folder::Ptr Folder::getSubFolder(unsigned int index) const
 {
-  unsigned int result = 0;
-  for (std::vector<Folder::Ptr>::const_iterator iter = m_SubFolders.begin();
-       iter != m_SubFolders.end(); ++iter) {
-    result += (*iter)->countFiles();
-  }
-  return result + static_cast<unsigned int>(m_Files.size());
+  return m_SubFolders.at(index);
 }
 
 const File::Ptr Folder::getFile(unsigned int index) const
@@ -201,8 +196,7 @@ Folder::Ptr Folder::addFolder(const std::string &folderName)
 {
   Folder::Ptr newFolder(new Folder);
   newFolder->m_Name = folderName;
-  newFolder->m_Parent = this;
-  m_SubFolders.push_back(newFolder);
+  addSubFolder(newFolder);
   return newFolder;
 }
 
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 
 namespace BSA {
@@ -49,7 +50,7 @@ public:
   /**
    * @return full path to this folder
    */
-  std::string getFullPath() const;
+  const std::string &getFullPath() const { return m_FullPath; }
   /**
    * @return the number of subfolders within this folder
    */
@@ -67,7 +68,7 @@ public:
   /**
    * @return the number of files in this folder and subfolder
    */
-  unsigned int countFiles() const;
+  unsigned int countFiles() const { return m_FileCount; }
   /**
    * @param index index of a file in this folder
    * @return a descriptor for the file
@@ -78,7 +79,7 @@ public:
    * adds a new file to the folder
    * @param file the new file to add
    */
-  void addFile(const File::Ptr &file) { m_Files.push_back(file); }
+  void addFile(const File::Ptr &file);
   /**
    * add an empty folder as a subfolder to this one.
    * @param folderName name of the new folder
@@ -100,33 +101,31 @@ private:
   Folder &operator=(const Folder &reference);
 
   /**
-   * factory function to read a folder object from disc. This also reads part of the information about the files within
-   * @param file file stream to read from, already placed at the correct position
-   * @param fileNamesLength length of the file names list. This is required to correctly calculate offsets
-   * @param endPos position inside file where the last folder header ends. This is
-   *               updated by the constructor so that it is the correct value after all folders are read
-   * @return the new Folder object
+   * place a folder in the tree below this one, creating the intermediate
+   * folders as necessary
+   * @param folder the folder to add. Its name is expected to be the path
+   *               relative to this folder and is reduced to the last component
    */
-  Folder::Ptr readFolder(std::fstream &file, BSAULong fileNamesLength, BSAULong &endPos);
+  void addFolderInt(Folder::Ptr folder);
 
   /**
-   * recursive function to determine the correct subfolder to place the new
-   * folder in
+   * find a direct subfolder by name, case-insensitively
+   * @return the subfolder or nullptr if there is none with that name
    */
-  void addFolderInt(Folder::Ptr folder);
+  Folder *findSubFolder(const char *name, size_t length) const;
+
+  void addSubFolder(const Folder::Ptr &folder);
 
   /**
-   * add a new folder to the structure. It will automatically be added to the
-   * correct sub-folder if applicable
+   * update the full path of this folder, its files and its subfolders
+   * after it was moved in the tree
    */
-  Folder::Ptr addFolder(std::fstream &file, BSAULong fileNamesLength, BSAULong &endPos);
-
-  bool resolveFileNames(std::fstream &file, bool testHashes);
+  void updateFullPath();
 
   void writeHeader(std::fstream &file) const;
   void writeData(std::fstream &file, BSAULong fileNamesLength) const;
-  EErrorCode writeFileData(std::fstream &sourceFile,
-                           std::fstream &targetFile) const;
+  EErrorCode writeFileData(std::fstream &sourceFile, const char *sourceMapping,
+                           size_t sourceMappingSize, std::fstream &targetFile) const;
   void collectFolders(std::vector<Folder::Ptr> &folderList) const;
   void collectFiles(std::vector<File::Ptr> &fileList) const;
   void collectFileNames(std::vector<std::string> &nameList) const;
@@ -135,11 +134,16 @@ private:
   Folder *m_Parent;
   BSAHash m_NameHash;
   std::string m_Name;
-  BSAULong m_FileCount;
-  BSAULong m_Offset;
   std::vector<Folder::Ptr> m_SubFolders;
+  // subfolders by the hash of their name, used to look them up during tree construction
+  std::unordered_multimap<BSAHash, Folder*> m_SubFolderMap;
   std::vector<File::Ptr> m_Files;
 
+  // full path and number of files in this folder and all subfolders,
+  // maintained as folders and files are added
+  std::string m_FullPath;
+  unsigned int m_FileCount;
+
   mutable BSAULong m_OffsetWrite;
 };
 
@@ -0,0 +1,434 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsaindex.h"
+#include "bsaexception.h"
+#include "filehash.h"
+#include <cstring>
+#include <algorithm>
+#include <boost/thread.hpp>
+
+
+namespace BSA {
+
+
+ArchiveIndex::ArchiveIndex()
+{
+  clear();
+}
+
+
+void ArchiveIndex::clear()
+{
+  m_FolderHashes.clear();
+  m_FolderNames.clear();
+  m_FolderFirstFile.assign(1, 0);
+  m_FileHashes.clear();
+  m_FileSizes.clear();
+  m_FileOffsets.clear();
+  m_FileNames.clear();
+  // offset 0 is the empty string, used for names that couldn't be read
+  m_Names.assign(1, '\0');
+  m_FolderOrder.clear();
+  m_FileOrder.clear();
+  m_FileNamesOffset = 0;
+  m_FileNamesLength = 0;
+  m_FileNamesRead = false;
+}
+
+
+BSAULong ArchiveIndex::addName(const char *begin, const char *end)
+{
+  BSAULong offset = static_cast<BSAULong>(m_Names.size());
+  m_Names.insert(m_Names.end(), begin, end);
+  m_Names.push_back('\0');
+  return offset;
+}
+
+
+void ArchiveIndex::read(const char *begin, const char *end, const char *folderRecords,
+                        BSAULong folderCount, BSAULong fileNamesLength)
+{
+  clear();
+
+  // the counts come from the header, don't reserve for more records than fit
+  const size_t folderRecordSize = sizeof(BSAHash) + 2 * sizeof(BSAULong);
+  if (static_cast<size_t>(end - folderRecords) / folderRecordSize < folderCount) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+
+  m_FolderHashes.reserve(folderCount);
+  m_FolderNames.reserve(folderCount);
+  m_FolderFirstFile.reserve(folderCount + 1);
+
+  // the file names follow the last block of file records
+  const char *fileNames = folderRecords;
+
+  for (BSAULong i = 0; i < folderCount; ++i) {
+    m_FolderHashes.push_back(readType<BSAHash>(folderRecords, end));
+    BSAULong fileCount = readType<BSAULong>(folderRecords, end);
+    BSAULong offset = readType<BSAULong>(folderRecords, end);
+
+    BSAULong recordOffset = offset - fileNamesLength;
+    if (recordOffset > static_cast<BSAULong>(end - begin)) {
+      throw data_invalid_exception("can't read from bsa");
+    }
+    const char *pos = begin + recordOffset;
+
+    unsigned char nameLength = readType<unsigned char>(pos, end);
+    if (static_cast<size_t>(end - pos) < nameLength) {
+      throw data_invalid_exception("can't read from bsa");
+    }
+    const char *nameEnd = static_cast<const char*>(memchr(pos, '\0', nameLength));
+    m_FolderNames.push_back(addName(pos, nameEnd != nullptr ? nameEnd : pos + nameLength));
+    pos += nameLength;
+
+    for (BSAULong j = 0; j < fileCount; ++j) {
+      m_FileHashes.push_back(readType<BSAHash>(pos, end));
+      m_FileSizes.push_back(readType<BSAULong>(pos, end));
+      m_FileOffsets.push_back(readType<BSAULong>(pos, end));
+    }
+    m_FolderFirstFile.push_back(static_cast<BSAULong>(m_FileHashes.size()));
+
+    fileNames = (std::max)(fileNames, pos);
+  }
+
+  m_FileNamesOffset = static_cast<BSAULong>(fileNames - begin);
+  m_FileNamesLength = fileNamesLength;
+
+  sortLookup();
+}
+
+
+bool ArchiveIndex::readFileNames(const char *fileNames, const char *end)
+{
+  m_FileNames.clear();
+  m_FileNames.reserve(m_FileHashes.size());
+  m_Names.reserve(m_Names.size() + m_FileHashes.size()
+                  + (std::min)(static_cast<size_t>(m_FileNamesLength),
+                               static_cast<size_t>(end - fileNames)));
+  m_FileNamesRead = true;
+
+  bool namesValid = true;
+  for (size_t i = 0; i < m_FileHashes.size(); ++i) {
+    const char *nameEnd = static_cast<const char*>(memchr(fileNames, '\0', end - fileNames));
+    if (nameEnd == nullptr) {
+      m_FileNames.push_back(0);
+      namesValid = false;
+      continue;
+    }
+    m_FileNames.push_back(addName(fileNames, nameEnd));
+    fileNames = nameEnd + 1;
+  }
+
+  return namesValid;
+}
+
+
+void ArchiveIndex::verifyFolders(BSAULong begin, BSAULong end,
+                                 std::vector<BSAULong> *mismatches) const
+{
+  for (BSAULong file = m_FolderFirstFile[begin]; file < m_FolderFirstFile[end]; ++file) {
+    const char *name = fileName(file);
+    if (calculateBSAHash(name, strlen(name)) != m_FileHashes[file]) {
+      mismatches->push_back(file);
+    }
+  }
+}
+
+
+std::vector<BSAULong> ArchiveIndex::verifyHashes(unsigned int threadCount) const
+{
+  // not worth starting a thread for fewer files than this
+  static const BSAULong MIN_FILES_PER_THREAD = 1024;
+
+  BSAULong maxThreads = numFiles() / MIN_FILES_PER_THREAD;
+  if (threadCount > maxThreads) {
+    threadCount = static_cast<unsigned int>(maxThreads);
+  }
+  if (threadCount == 0) {
+    threadCount = 1;
+  }
+
+  std::vector<std::vector<BSAULong> > mismatches(threadCount);
+  if (threadCount == 1) {
+    verifyFolders(0, numFolders(), &mismatches[0]);
+    return mismatches[0];
+  }
+
+  // split the folders into ranges of roughly the same number of files. The
+  // last range is checked on the calling thread
+  boost::thread_group threads;
+  BSAULong folder = 0;
+  for (unsigned int i = 0; i < threadCount; ++i) {
+    BSAULong filesEnd = static_cast<BSAULong>(
+          static_cast<unsigned long long>(numFiles()) * (i + 1) / threadCount);
+    BSAULong folderEnd = folder;
+    while ((folderEnd < numFolders()) && (m_FolderFirstFile[folderEnd] < filesEnd)) {
+      ++folderEnd;
+    }
+    if (i == threadCount - 1) {
+      verifyFolders(folder, numFolders(), &mismatches[i]);
+    } else {
+      threads.create_thread(boost::bind(&ArchiveIndex::verifyFolders, this,
+                                        folder, folderEnd, &mismatches[i]));
+    }
+    folder = folderEnd;
+  }
+  threads.join_all();
+
+  std::vector<BSAULong> result;
+  for (unsigned int i = 0; i < threadCount; ++i) {
+    result.insert(result.end(), mismatches[i].begin(), mismatches[i].end());
+  }
+  return result;
+}
+
+
+namespace {
+
+template <typename T>
+void saveVector(std::fstream &file, const std::vector<T> &vector)
+{
+  writeType<BSAULong>(file, static_cast<BSAULong>(vector.size()));
+  if (!vector.empty()) {
+    file.write(reinterpret_cast<const char*>(vector.data()), vector.size() * sizeof(T));
+  }
+}
+
+template <typename T>
+void loadVector(const char *&data, const char *end, std::vector<T> &vector)
+{
+  BSAULong size = readType<BSAULong>(data, end);
+  if (static_cast<size_t>(end - data) / sizeof(T) < size) {
+    throw data_invalid_exception("can't read index");
+  }
+  vector.resize(size);
+  if (size != 0) {
+    memcpy(vector.data(), data, size * sizeof(T));
+  }
+  data += size * sizeof(T);
+}
+
+// orders entry indices by hash and compares them to hashes
+class HashOrder {
+public:
+  explicit HashOrder(const std::vector<BSAHash> &hashes) : m_Hashes(hashes) {}
+  bool operator()(BSAULong LHS, BSAULong RHS) const { return m_Hashes[LHS] < m_Hashes[RHS]; }
+  bool operator()(BSAULong LHS, BSAHash RHS) const { return m_Hashes[LHS] < RHS; }
+private:
+  const std::vector<BSAHash> &m_Hashes;
+};
+
+// search a range of entries ordered by hash
+template <typename Iterator>
+BSAULong findHash(Iterator begin, Iterator end, const std::vector<BSAHash> &hashes,
+                  BSAHash hash)
+{
+  Iterator iter = std::lower_bound(begin, end, hash, HashOrder(hashes));
+  if ((iter != end) && (hashes[*iter] == hash)) {
+    return *iter;
+  }
+  return ArchiveIndex::NOT_FOUND;
+}
+
+}
+
+
+void ArchiveIndex::sortLookup()
+{
+  if (!std::is_sorted(m_FolderHashes.begin(), m_FolderHashes.end())) {
+    m_FolderOrder.resize(m_FolderHashes.size());
+    for (BSAULong i = 0; i < m_FolderOrder.size(); ++i) {
+      m_FolderOrder[i] = i;
+    }
+    std::stable_sort(m_FolderOrder.begin(), m_FolderOrder.end(), HashOrder(m_FolderHashes));
+  }
+
+  bool filesSorted = true;
+  for (BSAULong i = 0; (i < numFolders()) && filesSorted; ++i) {
+    filesSorted = std::is_sorted(m_FileHashes.begin() + m_FolderFirstFile[i],
+                                 m_FileHashes.begin() + m_FolderFirstFile[i + 1]);
+  }
+  if (!filesSorted) {
+    m_FileOrder.resize(m_FileHashes.size());
+    for (BSAULong i = 0; i < m_FileOrder.size(); ++i) {
+      m_FileOrder[i] = i;
+    }
+    for (BSAULong i = 0; i < numFolders(); ++i) {
+      std::stable_sort(m_FileOrder.begin() + m_FolderFirstFile[i],
+                       m_FileOrder.begin() + m_FolderFirstFile[i + 1],
+                       HashOrder(m_FileHashes));
+    }
+  }
+}
+
+
+BSAULong ArchiveIndex::findFolder(BSAHash hash) const
+{
+  if (m_FolderOrder.empty()) {
+    std::vector<BSAHash>::const_iterator iter
+        = std::lower_bound(m_FolderHashes.begin(), m_FolderHashes.end(), hash);
+    if ((iter != m_FolderHashes.end()) && (*iter == hash)) {
+      return static_cast<BSAULong>(iter - m_FolderHashes.begin());
+    }
+    return NOT_FOUND;
+  } else {
+    return findHash(m_FolderOrder.begin(), m_FolderOrder.end(), m_FolderHashes, hash);
+  }
+}
+
+
+BSAULong ArchiveIndex::findFile(BSAULong folder, BSAHash hash) const
+{
+  if (m_FileOrder.empty()) {
+    std::vector<BSAHash>::const_iterator begin = m_FileHashes.begin() + m_FolderFirstFile[folder];
+    std::vector<BSAHash>::const_iterator end = m_FileHashes.begin() + m_FolderFirstFile[folder + 1];
+    std::vector<BSAHash>::const_iterator iter = std::lower_bound(begin, end, hash);
+    if ((iter != end) && (*iter == hash)) {
+      return static_cast<BSAULong>(iter - m_FileHashes.begin());
+    }
+    return NOT_FOUND;
+  } else {
+    return findHash(m_FileOrder.begin() + m_FolderFirstFile[folder],
+                    m_FileOrder.begin() + m_FolderFirstFile[folder + 1],
+                    m_FileHashes, hash);
+  }
+}
+
+
+BSAULong ArchiveIndex::findFolder(const std::string &path) const
+{
+  std::string::size_type begin = path.find_first_not_of("\\/");
+  if (begin == std::string::npos) {
+    return findFolder(calculateBSAFolderHash(std::string()));
+  }
+  std::string::size_type end = path.find_last_not_of("\\/");
+  return findFolder(calculateBSAFolderHash(path.c_str() + begin, end - begin + 1));
+}
+
+
+BSAULong ArchiveIndex::findFile(const std::string &path) const
+{
+  std::string::size_type separator = path.find_last_of("\\/");
+  BSAULong folder = separator == std::string::npos
+      ? findFolder(std::string())
+      : findFolder(path.substr(0, separator));
+  if (folder == NOT_FOUND) {
+    return NOT_FOUND;
+  }
+  std::string::size_type nameStart = separator == std::string::npos ? 0 : separator + 1;
+  return findFile(folder, calculateBSAHash(path.c_str() + nameStart, path.length() - nameStart));
+}
+
+
+void ArchiveIndex::save(std::fstream &file) const
+{
+  writeType<BSAULong>(file, m_FileNamesOffset);
+  writeType<BSAULong>(file, m_FileNamesLength);
+  writeType<unsigned char>(file, m_FileNamesRead ? 1 : 0);
+  saveVector(file, m_FolderHashes);
+  saveVector(file, m_FolderNames);
+  saveVector(file, m_FolderFirstFile);
+  saveVector(file, m_FileHashes);
+  saveVector(file, m_FileSizes);
+  saveVector(file, m_FileOffsets);
+  saveVector(file, m_FileNames);
+  saveVector(file, m_Names);
+  saveVector(file, m_FolderOrder);
+  saveVector(file, m_FileOrder);
+}
+
+
+bool ArchiveIndex::load(const char *&data, const char *end)
+{
+  try {
+    m_FileNamesOffset = readType<BSAULong>(data, end);
+    m_FileNamesLength = readType<BSAULong>(data, end);
+    m_FileNamesRead = readType<unsigned char>(data, end) != 0;
+    loadVector(data, end, m_FolderHashes);
+    loadVector(data, end, m_FolderNames);
+    loadVector(data, end, m_FolderFirstFile);
+    loadVector(data, end, m_FileHashes);
+    loadVector(data, end, m_FileSizes);
+    loadVector(data, end, m_FileOffsets);
+    loadVector(data, end, m_FileNames);
+    loadVector(data, end, m_Names);
+    loadVector(data, end, m_FolderOrder);
+    loadVector(data, end, m_FileOrder);
+  } catch (const data_invalid_exception&) {
+    clear();
+    return false;
+  }
+  if (!consistent()) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+
+bool ArchiveIndex::consistent() const
+{
+  size_t folders = m_FolderHashes.size();
+  size_t files = m_FileHashes.size();
+  if ((m_FolderNames.size() != folders)
+      || (m_FolderFirstFile.size() != folders + 1)
+      || (m_FolderFirstFile.front() != 0)
+      || (m_FolderFirstFile.back() != files)
+      || !std::is_sorted(m_FolderFirstFile.begin(), m_FolderFirstFile.end())
+      || (m_FileSizes.size() != files)
+      || (m_FileOffsets.size() != files)
+      || (m_FileNames.size() != (m_FileNamesRead ? files : 0))
+      || (!m_FolderOrder.empty() && (m_FolderOrder.size() != folders))
+      || (!m_FileOrder.empty() && (m_FileOrder.size() != files))
+      || m_Names.empty() || (m_Names.back() != '\0')) {
+    return false;
+  }
+
+  for (size_t i = 0; i < folders; ++i) {
+    if ((m_FolderNames[i] >= m_Names.size())
+        || (!m_FolderOrder.empty() && (m_FolderOrder[i] >= folders))) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < m_FileNames.size(); ++i) {
+    if (m_FileNames[i] >= m_Names.size()) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < m_FileOrder.size(); ++i) {
+    if (m_FileOrder[i] >= files) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+BSAULong ArchiveIndex::fileFolder(BSAULong file) const
+{
+  std::vector<BSAULong>::const_iterator iter
+      = std::upper_bound(m_FolderFirstFile.begin(), m_FolderFirstFile.end(), file);
+  return static_cast<BSAULong>(iter - m_FolderFirstFile.begin()) - 1;
+}
+
+
+} // namespace BSA
@@ -0,0 +1,237 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef BSAINDEX_H
+#define BSAINDEX_H
+
+
+#include "bsatypes.h"
+#include <string>
+#include <vector>
+
+
+namespace BSA {
+
+
+/**
+ * @brief compact, read-only index of the folders and files stored in an archive.
+ * Records are kept in flat arrays (folders in archive order, files grouped by
+ * folder) and all names share a single string pool. Folders and files are
+ * referred to by their position in these arrays
+ */
+class ArchiveIndex {
+
+public:
+
+  // returned by the lookup functions if there is no matching entry
+  static const BSAULong NOT_FOUND = 0xFFFFFFFF;
+
+public:
+
+  ArchiveIndex();
+
+  /**
+   * read the folder and file records from the archive directory. File names
+   * are read separately through readFileNames
+   * @param begin start of the archive in memory
+   * @param end end of the archive directory in memory
+   * @param folderRecords position of the first folder record
+   * @param folderCount number of folder records
+   * @param fileNamesLength length of the file names list. This is required to correctly calculate offsets
+   * @throw data_invalid_exception if the folder or file records are invalid
+   */
+  void read(const char *begin, const char *end, const char *folderRecords,
+            BSAULong folderCount, BSAULong fileNamesLength);
+
+  /**
+   * read the file names
+   * @param fileNames start of the file name list in memory
+   * @param end end of the buffer containing the list
+   * @return false if a file name couldn't be read
+   */
+  bool readFileNames(const char *fileNames, const char *end);
+
+  /**
+   * compare the hashes of all file names with those stored in the archive.
+   * The folders are split among the specified number of threads
+   * @param threadCount maximum number of threads to use. Small archives are
+   *                    checked with fewer threads
+   * @return indices of all files whose name doesn't match the hash, in
+   *         ascending order. Empty if all hashes match
+   * @note the file names have to be read
+   */
+  std::vector<BSAULong> verifyHashes(unsigned int threadCount) const;
+
+  /**
+   * @return true if the file names have been read. Until then all file names are empty
+   */
+  bool fileNamesRead() const { return m_FileNamesRead; }
+  /**
+   * @return offset of the file name list within the archive
+   */
+  BSAULong fileNamesOffset() const { return m_FileNamesOffset; }
+  /**
+   * @return length of the file name list according to the archive header
+   */
+  BSAULong fileNamesLength() const { return m_FileNamesLength; }
+
+  /**
+   * write the index in a flat binary format that can be loaded without
+   * parsing the archive again. The format is only meant for caching on the
+   * same system and isn't portable. It has no version number of its own, the
+   * index cache file written by Archive stores one in its header
+   * @param file the stream to write to
+   */
+  void save(std::fstream &file) const;
+
+  /**
+   * load an index written by save
+   * @param data start of the saved index in memory. This is advanced past the index
+   * @param end end of the buffer
+   * @return false if the data isn't a consistent index. The index is empty in this case
+   */
+  bool load(const char *&data, const char *end);
+
+  /**
+   * remove all entries
+   */
+  void clear();
+
+  /**
+   * @return number of folders in the archive
+   */
+  BSAULong numFolders() const { return static_cast<BSAULong>(m_FolderHashes.size()); }
+  /**
+   * @return number of files in the archive
+   */
+  BSAULong numFiles() const { return static_cast<BSAULong>(m_FileHashes.size()); }
+
+  BSAHash folderHash(BSAULong folder) const { return m_FolderHashes[folder]; }
+  /**
+   * @return full path of the folder as stored in the archive
+   */
+  const char *folderName(BSAULong folder) const { return &m_Names[m_FolderNames[folder]]; }
+  /**
+   * @return index of the first file in the folder
+   */
+  BSAULong firstFile(BSAULong folder) const { return m_FolderFirstFile[folder]; }
+  /**
+   * @return number of files in the folder
+   */
+  BSAULong folderFileCount(BSAULong folder) const { return m_FolderFirstFile[folder + 1] - m_FolderFirstFile[folder]; }
+
+  /**
+   * @return index of the folder containing the file
+   */
+  BSAULong fileFolder(BSAULong file) const;
+  BSAHash fileHash(BSAULong file) const { return m_FileHashes[file]; }
+  const char *fileName(BSAULong file) const { return &m_Names[m_FileNamesRead ? m_FileNames[file] : 0]; }
+  /**
+   * @return size of the file data in the archive (the compressed size for compressed files)
+   */
+  BSAULong fileSize(BSAULong file) const { return m_FileSizes[file] & ~FLAG_TOGGLECOMPRESSED; }
+  BSAULong fileOffset(BSAULong file) const { return m_FileOffsets[file]; }
+  /**
+   * @return true if the compression of the file differs from the archive default
+   */
+  bool fileCompressToggled(BSAULong file) const { return (m_FileSizes[file] & FLAG_TOGGLECOMPRESSED) != 0; }
+
+  /**
+   * look up a folder by the hash of its path
+   * @param hash hash as calculated by calculateBSAFolderHash
+   * @return index of the folder or NOT_FOUND
+   */
+  BSAULong findFolder(BSAHash hash) const;
+  /**
+   * look up a file within a folder by the hash of its name
+   * @param folder index of the folder to search
+   * @param hash hash as calculated by calculateBSAHash
+   * @return index of the file or NOT_FOUND
+   */
+  BSAULong findFile(BSAULong folder, BSAHash hash) const;
+  /**
+   * look up a folder by its path. Only hashes are compared, case and type of
+   * slashes don't matter
+   * @param path path of the folder, i.e. "meshes\\clutter"
+   * @return index of the folder or NOT_FOUND
+   */
+  BSAULong findFolder(const std::string &path) const;
+  /**
+   * look up a file by its path. Only hashes are compared, case and type of
+   * slashes don't matter
+   * @param path path of the file, i.e. "meshes\\clutter\\bucket01.nif"
+   * @return index of the file or NOT_FOUND
+   */
+  BSAULong findFile(const std::string &path) const;
+
+private:
+
+  // set in the size field of a file record if compression is toggled
+  static const BSAULong FLAG_TOGGLECOMPRESSED = 1 << 30;
+
+  BSAULong addName(const char *begin, const char *end);
+
+  /**
+   * set up the lookup order for archives that aren't sorted by hash
+   */
+  void sortLookup();
+
+  /**
+   * verify the file name hashes of a range of folders
+   */
+  void verifyFolders(BSAULong begin, BSAULong end, std::vector<BSAULong> *mismatches) const;
+
+  /**
+   * @return true if all arrays fit together and all offsets are in range
+   */
+  bool consistent() const;
+
+private:
+
+  std::vector<BSAHash> m_FolderHashes;
+  std::vector<BSAULong> m_FolderNames;
+  // first file of each folder, with one extra element for the end of the last
+  std::vector<BSAULong> m_FolderFirstFile;
+
+  std::vector<BSAHash> m_FileHashes;
+  // sizes as stored in the archive, including the compression toggle bit
+  std::vector<BSAULong> m_FileSizes;
+  std::vector<BSAULong> m_FileOffsets;
+  std::vector<BSAULong> m_FileNames;
+
+  // zero-terminated folder and file names
+  std::vector<char> m_Names;
+
+  BSAULong m_FileNamesOffset;
+  BSAULong m_FileNamesLength;
+  bool m_FileNamesRead;
+
+  // folders and files ordered by hash (within each folder) for lookups.
+  // Empty if the archive is already sorted, which is the norm
+  std::vector<BSAULong> m_FolderOrder;
+  std::vector<BSAULong> m_FileOrder;
+
+};
+
+
+} // namespace BSA
+
+#endif // BSAINDEX_H
@@ -0,0 +1,144 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsainflater.h"
+#include <cstring>
+#ifdef BSA_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif // BSA_USE_LIBDEFLATE
+
+
+namespace BSA {
+
+
+Inflater::Inflater()
+  : m_Initialized(false)
+#ifdef BSA_USE_LIBDEFLATE
+  , m_Decompressor(nullptr)
+#endif // BSA_USE_LIBDEFLATE
+{
+  m_Stream.zalloc = Z_NULL;
+  m_Stream.zfree = Z_NULL;
+  m_Stream.opaque = Z_NULL;
+  m_Stream.next_in = Z_NULL;
+  m_Stream.avail_in = 0;
+}
+
+
+Inflater::~Inflater()
+{
+  if (m_Initialized) {
+    BSA_ZLIB(inflateEnd)(&m_Stream);
+  }
+#ifdef BSA_USE_LIBDEFLATE
+  if (m_Decompressor != nullptr) {
+    libdeflate_free_decompressor(m_Decompressor);
+  }
+#endif // BSA_USE_LIBDEFLATE
+}
+
+
+EErrorCode Inflater::reset()
+{
+  if (!m_Initialized) {
+    if (BSA_ZLIB(inflateInit)(&m_Stream) != Z_OK) {
+      return ERROR_ZLIBINITFAILED;
+    }
+    m_Initialized = true;
+  } else if (BSA_ZLIB(inflateReset)(&m_Stream) != Z_OK) {
+    return ERROR_ZLIBINITFAILED;
+  }
+  m_Stream.avail_in = 0;
+  return ERROR_NONE;
+}
+
+
+EErrorCode Inflater::inflate(const unsigned char *inBuffer, BSAULong inSize,
+                             unsigned char *outBuffer, BSAULong outSize)
+{
+#ifdef BSA_USE_LIBDEFLATE
+  if (m_Decompressor == nullptr) {
+    m_Decompressor = libdeflate_alloc_decompressor();
+  }
+  if (m_Decompressor != nullptr) {
+    size_t length = 0;
+    if (libdeflate_zlib_decompress(m_Decompressor, inBuffer, inSize,
+                                   outBuffer, outSize, &length) == LIBDEFLATE_SUCCESS) {
+      if (length < outSize) {
+        memset(outBuffer + length, 0, outSize - length);
+      }
+      return ERROR_NONE;
+    }
+    // truncated or oversized streams and trailing data are rejected by
+    // libdeflate but tolerated below
+  }
+#endif // BSA_USE_LIBDEFLATE
+
+  EErrorCode result = reset();
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  m_Stream.next_in = const_cast<unsigned char*>(inBuffer);
+  m_Stream.avail_in = inSize;
+  m_Stream.next_out = outBuffer;
+  m_Stream.avail_out = outSize;
+
+  // a truncated stream (Z_BUF_ERROR) is tolerated, as is data exceeding
+  // the expected size
+  int zlibRet = BSA_ZLIB(inflate)(&m_Stream, Z_FINISH);
+  if ((zlibRet != Z_OK) && (zlibRet != Z_STREAM_END) && (zlibRet != Z_BUF_ERROR)) {
+    return ERROR_INVALIDDATA;
+  }
+
+  if (m_Stream.avail_out != 0) {
+    memset(m_Stream.next_out, 0, m_Stream.avail_out);
+  }
+  return ERROR_NONE;
+}
+
+
+void Inflater::setInput(const unsigned char *inBuffer, BSAULong inSize)
+{
+  m_Stream.next_in = const_cast<unsigned char*>(inBuffer);
+  m_Stream.avail_in = inSize;
+}
+
+
+EErrorCode Inflater::inflateChunk(unsigned char *outBuffer, BSAULong outSize,
+                                  BSAULong &produced, bool &finished)
+{
+  m_Stream.next_out = outBuffer;
+  m_Stream.avail_out = outSize;
+
+  // Z_BUF_ERROR only means that no progress was possible without more input
+  int zlibRet = BSA_ZLIB(inflate)(&m_Stream, Z_NO_FLUSH);
+  if ((zlibRet != Z_OK) && (zlibRet != Z_STREAM_END) && (zlibRet != Z_BUF_ERROR)) {
+    return ERROR_INVALIDDATA;
+  }
+
+  produced = outSize - m_Stream.avail_out;
+  finished = zlibRet == Z_STREAM_END;
+  return ERROR_NONE;
+}
+
+
+} // namespace BSA
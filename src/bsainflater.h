@@ -0,0 +1,130 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#ifndef BSAINFLATER_H
+#define BSAINFLATER_H
+
+
+#include "bsatypes.h"
+#include "errorcodes.h"
+
+// the zlib implementation is selected at build time. zlib-ng can also be
+// used in its zlib compatible build without defining anything
+#ifdef BSA_USE_ZLIBNG
+#include <zlib-ng.h>
+#define BSA_ZLIB(name) ::zng_##name
+typedef zng_stream BSAZStream;
+#else // BSA_USE_ZLIBNG
+#include <zlib.h>
+#define BSA_ZLIB(name) ::name
+typedef z_stream BSAZStream;
+#endif // BSA_USE_ZLIBNG
+
+#ifdef BSA_USE_LIBDEFLATE
+struct libdeflate_decompressor;
+#endif // BSA_USE_LIBDEFLATE
+
+
+namespace BSA {
+
+
+/**
+ * @brief zlib decompression context that is set up once and reset between
+ * files instead of being initialized for every file. An instance must only
+ * be used by one thread at a time.
+ * Streams are decompressed with zlib or, if BSA_USE_ZLIBNG is defined, with
+ * the native API of zlib-ng. If BSA_USE_LIBDEFLATE is defined, inflate
+ * decompresses with libdeflate and only falls back to zlib for streams
+ * libdeflate rejects, so the output is the same with all backends
+ */
+class Inflater {
+
+public:
+
+  Inflater();
+  ~Inflater();
+
+  /**
+   * decompress a zlib stream
+   * @param inBuffer the compressed data
+   * @param inSize size of the compressed data
+   * @param outBuffer receives the decompressed data
+   * @param outSize expected size of the decompressed data. If the stream
+   *                ends early the rest of the buffer is zeroed
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode inflate(const unsigned char *inBuffer, BSAULong inSize,
+                     unsigned char *outBuffer, BSAULong outSize);
+
+  /**
+   * start decompressing a new stream piece by piece. The compressed data is
+   * passed in through setInput and decompressed through inflateChunk, so
+   * neither the compressed nor the decompressed data has to be in memory as
+   * a whole
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode reset();
+
+  /**
+   * pass the next part of the compressed data. The buffer has to stay valid
+   * until inputConsumed returns true
+   */
+  void setInput(const unsigned char *inBuffer, BSAULong inSize);
+
+  /**
+   * @return true if all data passed to setInput has been processed
+   */
+  bool inputConsumed() const { return m_Stream.avail_in == 0; }
+
+  /**
+   * decompress as much of the input as fits into the output buffer
+   * @param outBuffer receives the decompressed data
+   * @param outSize size of the output buffer
+   * @param produced receives the number of bytes written to the output buffer
+   * @param finished set to true once the end of the stream has been reached
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode inflateChunk(unsigned char *outBuffer, BSAULong outSize,
+                          BSAULong &produced, bool &finished);
+
+private:
+
+  // copy constructor not implemented
+  Inflater(const Inflater &reference);
+
+  // assignment operator not implemented
+  Inflater &operator=(const Inflater &reference);
+
+private:
+
+  BSAZStream m_Stream;
+  bool m_Initialized;
+#ifdef BSA_USE_LIBDEFLATE
+  libdeflate_decompressor *m_Decompressor;
+#endif // BSA_USE_LIBDEFLATE
+
+};
+
+
+} // namespace BSA
+
+#endif // BSAINFLATER_H
@@ -0,0 +1,183 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsaioring.h"
+
+#ifdef BSA_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+
+namespace BSA {
+
+
+IoRing::IoRing()
+  : m_Fd(-1)
+  , m_SubmissionRing(MAP_FAILED), m_SubmissionRingSize(0)
+  , m_CompletionRing(MAP_FAILED), m_CompletionRingSize(0)
+  , m_Submissions(nullptr), m_SubmissionsSize(0)
+  , m_Queued(0)
+{
+}
+
+
+IoRing::~IoRing()
+{
+  if (m_Submissions != nullptr) {
+    munmap(m_Submissions, m_SubmissionsSize);
+  }
+  if ((m_CompletionRing != MAP_FAILED) && (m_CompletionRing != m_SubmissionRing)) {
+    munmap(m_CompletionRing, m_CompletionRingSize);
+  }
+  if (m_SubmissionRing != MAP_FAILED) {
+    munmap(m_SubmissionRing, m_SubmissionRingSize);
+  }
+  if (m_Fd >= 0) {
+    ::close(m_Fd);
+  }
+}
+
+
+bool IoRing::init(unsigned int entries)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  m_Fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (m_Fd < 0) {
+    return false;
+  }
+
+  m_SubmissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  m_CompletionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMapping) {
+    m_SubmissionRingSize = m_CompletionRingSize
+        = (std::max)(m_SubmissionRingSize, m_CompletionRingSize);
+  }
+
+  m_SubmissionRing = mmap(nullptr, m_SubmissionRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQ_RING);
+  if (m_SubmissionRing == MAP_FAILED) {
+    return false;
+  }
+  if (singleMapping) {
+    m_CompletionRing = m_SubmissionRing;
+  } else {
+    m_CompletionRing = mmap(nullptr, m_CompletionRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_CQ_RING);
+    if (m_CompletionRing == MAP_FAILED) {
+      return false;
+    }
+  }
+
+  m_SubmissionsSize = params.sq_entries * sizeof(io_uring_sqe);
+  void *submissions = mmap(nullptr, m_SubmissionsSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQES);
+  if (submissions == MAP_FAILED) {
+    return false;
+  }
+  m_Submissions = static_cast<io_uring_sqe*>(submissions);
+
+  char *submissionRing = static_cast<char*>(m_SubmissionRing);
+  m_SubmissionHead = reinterpret_cast<unsigned int*>(submissionRing + params.sq_off.head);
+  m_SubmissionTail = reinterpret_cast<unsigned int*>(submissionRing + params.sq_off.tail);
+  m_SubmissionMask = *reinterpret_cast<unsigned int*>(submissionRing + params.sq_off.ring_mask);
+  m_SubmissionEntries = params.sq_entries;
+  m_SubmissionArray = reinterpret_cast<unsigned int*>(submissionRing + params.sq_off.array);
+
+  char *completionRing = static_cast<char*>(m_CompletionRing);
+  m_CompletionHead = reinterpret_cast<unsigned int*>(completionRing + params.cq_off.head);
+  m_CompletionTail = reinterpret_cast<unsigned int*>(completionRing + params.cq_off.tail);
+  m_CompletionMask = *reinterpret_cast<unsigned int*>(completionRing + params.cq_off.ring_mask);
+  m_Completions = reinterpret_cast<io_uring_cqe*>(completionRing + params.cq_off.cqes);
+
+  return true;
+}
+
+
+bool IoRing::queueRead(int fd, void *buffer, unsigned int size, unsigned long long offset,
+                       unsigned long long userData)
+{
+  // the tail is only written by this side, the head is advanced by the kernel
+  unsigned int tail = *m_SubmissionTail;
+  unsigned int head = __atomic_load_n(m_SubmissionHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= m_SubmissionEntries) {
+    return false;
+  }
+
+  unsigned int index = tail & m_SubmissionMask;
+  io_uring_sqe *submission = &m_Submissions[index];
+  memset(submission, 0, sizeof(io_uring_sqe));
+  submission->opcode = IORING_OP_READ;
+  submission->fd = fd;
+  submission->addr = reinterpret_cast<unsigned long long>(buffer);
+  submission->len = size;
+  submission->off = offset;
+  submission->user_data = userData;
+  m_SubmissionArray[index] = index;
+
+  __atomic_store_n(m_SubmissionTail, tail + 1, __ATOMIC_RELEASE);
+  ++m_Queued;
+  return true;
+}
+
+
+bool IoRing::submit(unsigned int waitFor)
+{
+  while ((m_Queued > 0) || (waitFor > 0)) {
+    int res = static_cast<int>(syscall(__NR_io_uring_enter, m_Fd, m_Queued, waitFor,
+                                       waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    m_Queued -= (std::min)(static_cast<unsigned int>(res), m_Queued);
+    waitFor = 0;
+  }
+  return true;
+}
+
+
+bool IoRing::popCompletion(unsigned long long &userData, int &result)
+{
+  unsigned int head = *m_CompletionHead;
+  if (head == __atomic_load_n(m_CompletionTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const io_uring_cqe &completion = m_Completions[head & m_CompletionMask];
+  userData = completion.user_data;
+  result = completion.res;
+  __atomic_store_n(m_CompletionHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+} // namespace BSA
+
+#endif // BSA_HAVE_IO_URING
@@ -0,0 +1,143 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#ifndef BSAIORING_H
+#define BSAIORING_H
+
+
+// io_uring is only available on Linux and only used if the kernel headers
+// support IORING_OP_READ (5.6 and later). That is an enumerator, so the
+// headers are recognized by IORING_FEAT_CUR_PERSONALITY from the same release.
+// With older headers extraction uses positional reads
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_CUR_PERSONALITY
+#define BSA_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+
+#ifdef BSA_HAVE_IO_URING
+
+
+#include <cstddef>
+
+
+namespace BSA {
+
+
+/**
+ * @brief minimal io_uring submission and completion queue for reading files
+ * with many requests in flight. Requests are queued without a system call and
+ * submitted in batches. An instance must only be used by one thread at a time
+ */
+class IoRing {
+
+public:
+
+  IoRing();
+  ~IoRing();
+
+  /**
+   * set up the ring
+   * @param entries maximum number of requests in flight
+   * @return false if io_uring isn't supported or not permitted
+   */
+  bool init(unsigned int entries);
+
+  /**
+   * queue a read request. It's not passed to the kernel before the next
+   * call to submit
+   * @param fd file to read from
+   * @param buffer receives the data. Has to stay valid until the request completes
+   * @param size number of bytes to read
+   * @param offset position in the file to read from
+   * @param userData returned with the completion of the request
+   * @return false if the submission queue is full
+   */
+  bool queueRead(int fd, void *buffer, unsigned int size, unsigned long long offset,
+                 unsigned long long userData);
+
+  /**
+   * @return number of requests queued but not yet submitted
+   */
+  unsigned int queued() const { return m_Queued; }
+
+  /**
+   * pass all queued requests to the kernel
+   * @param waitFor number of completions to wait for
+   * @return false if the requests couldn't be submitted, i.e. because the
+   *         kernel is temporarily out of resources
+   */
+  bool submit(unsigned int waitFor);
+
+  /**
+   * fetch a completion
+   * @param userData receives the user data of the completed request
+   * @param result receives the number of bytes read or a negative error code
+   * @return false if no completion is available
+   */
+  bool popCompletion(unsigned long long &userData, int &result);
+
+private:
+
+  // copy constructor not implemented
+  IoRing(const IoRing &reference);
+
+  // assignment operator not implemented
+  IoRing &operator=(const IoRing &reference);
+
+private:
+
+  int m_Fd;
+
+  void *m_SubmissionRing;
+  size_t m_SubmissionRingSize;
+  void *m_CompletionRing;
+  size_t m_CompletionRingSize;
+  io_uring_sqe *m_Submissions;
+  size_t m_SubmissionsSize;
+
+  unsigned int *m_SubmissionHead;
+  unsigned int *m_SubmissionTail;
+  unsigned int m_SubmissionMask;
+  unsigned int m_SubmissionEntries;
+  unsigned int *m_SubmissionArray;
+
+  unsigned int *m_CompletionHead;
+  unsigned int *m_CompletionTail;
+  unsigned int m_CompletionMask;
+  io_uring_cqe *m_Completions;
+
+  unsigned int m_Queued;
+
+};
+
+
+} // namespace BSA
+
+
+#endif // BSA_HAVE_IO_URING
+
+#endif // BSAIORING_H
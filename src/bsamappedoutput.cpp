@@ -0,0 +1,136 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsamappedoutput.h"
+#include "bsaoutputfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif // WIN32
+
+
+namespace BSA {
+
+
+#ifdef WIN32
+
+
+MappedOutputFile::MappedOutputFile()
+  : m_Data(nullptr), m_Size(0), m_Mapping(nullptr)
+{
+}
+
+
+bool MappedOutputFile::map(OutputFile &file, size_t size)
+{
+  unmap();
+  // creating the mapping extends the file to its size
+  unsigned long long mappingSize = size;
+  m_Mapping = ::CreateFileMappingA(file.handle(), nullptr, PAGE_READWRITE,
+                                   static_cast<DWORD>(mappingSize >> 32),
+                                   static_cast<DWORD>(mappingSize), nullptr);
+  if (m_Mapping != nullptr) {
+    m_Data = static_cast<unsigned char*>(::MapViewOfFile(m_Mapping, FILE_MAP_WRITE, 0, 0, size));
+  }
+  if (m_Data == nullptr) {
+    unmap();
+    LARGE_INTEGER start;
+    start.QuadPart = 0;
+    ::SetFilePointerEx(file.handle(), start, nullptr, FILE_BEGIN);
+    ::SetEndOfFile(file.handle());
+    return false;
+  }
+  m_Size = size;
+  return true;
+}
+
+
+bool MappedOutputFile::unmap()
+{
+  bool result = true;
+  if (m_Data != nullptr) {
+    result = ::UnmapViewOfFile(m_Data) != FALSE;
+    m_Data = nullptr;
+  }
+  if (m_Mapping != nullptr) {
+    ::CloseHandle(m_Mapping);
+    m_Mapping = nullptr;
+  }
+  m_Size = 0;
+  return result;
+}
+
+
+#else // WIN32
+
+
+MappedOutputFile::MappedOutputFile()
+  : m_Data(nullptr), m_Size(0)
+{
+}
+
+
+bool MappedOutputFile::map(OutputFile &file, size_t size)
+{
+  unmap();
+  // the space has to be allocated up front. Writing to a page of a sparse
+  // file raises SIGBUS if the disk is full
+  void *data = MAP_FAILED;
+  if (::posix_fallocate(file.descriptor(), 0, static_cast<off_t>(size)) == 0) {
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.descriptor(), 0);
+  }
+  if (data == MAP_FAILED) {
+    // part of the space may have been allocated. If this fails, writing
+    // the file normally fails as well
+    int result = ::ftruncate(file.descriptor(), 0);
+    static_cast<void>(result);
+    return false;
+  }
+  m_Data = static_cast<unsigned char*>(data);
+  m_Size = size;
+  return true;
+}
+
+
+bool MappedOutputFile::unmap()
+{
+  bool result = true;
+  if (m_Data != nullptr) {
+    result = ::munmap(m_Data, m_Size) == 0;
+    m_Data = nullptr;
+  }
+  m_Size = 0;
+  return result;
+}
+
+
+#endif // WIN32
+
+
+MappedOutputFile::~MappedOutputFile()
+{
+  unmap();
+}
+
+
+} // namespace BSA
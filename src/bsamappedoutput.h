@@ -0,0 +1,91 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef BSAMAPPEDOUTPUT_H
+#define BSAMAPPEDOUTPUT_H
+
+
+#include <cstddef>
+
+#ifdef WIN32
+#include <Windows.h>
+#endif // WIN32
+
+
+namespace BSA {
+
+
+class OutputFile;
+
+
+/**
+ * @brief memory mapping of an output file of a known size. Data can be
+ * decompressed straight into the file without an intermediate buffer
+ */
+class MappedOutputFile {
+
+public:
+
+  MappedOutputFile();
+  ~MappedOutputFile();
+
+  /**
+   * allocate the space of an output file and map it for writing
+   * @param file the file to map, opened but still empty
+   * @param size size of the file. Must not be 0
+   * @return true on success. If this fails the file is left empty
+   */
+  bool map(OutputFile &file, size_t size);
+
+  /**
+   * unmap the file. The file itself stays open
+   * @return false if the mapping couldn't be removed properly
+   */
+  bool unmap();
+
+  /**
+   * @return start of the mapped file, nullptr if no file is mapped
+   */
+  unsigned char *data() const { return m_Data; }
+
+private:
+
+  // copy constructor not implemented
+  MappedOutputFile(const MappedOutputFile &reference);
+
+  // assignment operator not implemented
+  MappedOutputFile &operator=(const MappedOutputFile &reference);
+
+private:
+
+  unsigned char *m_Data;
+  size_t m_Size;
+
+#ifdef WIN32
+  HANDLE m_Mapping;
+#endif // WIN32
+
+};
+
+
+} // namespace BSA
+
+#endif // BSAMAPPEDOUTPUT_H
@@ -0,0 +1,508 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsaoutputfile.h"
+#include <algorithm>
+#include <map>
+#include <cctype>
+#include <cstring>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif // WIN32
+
+
+namespace BSA {
+
+
+#ifdef WIN32
+static const char SEPARATOR = '\\';
+#else
+static const char SEPARATOR = '/';
+#endif // WIN32
+
+
+#ifdef WIN32
+
+
+OutputFile::OutputFile()
+  : m_Handle(INVALID_HANDLE_VALUE), m_Existed(false)
+{
+}
+
+
+bool OutputFile::open(const char *fileName, bool replace)
+{
+  close();
+  m_Handle = ::CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                           replace ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  m_Existed = (m_Handle == INVALID_HANDLE_VALUE) && (::GetLastError() == ERROR_FILE_EXISTS);
+  return m_Handle != INVALID_HANDLE_VALUE;
+}
+
+
+bool OutputFile::isOpen() const
+{
+  return m_Handle != INVALID_HANDLE_VALUE;
+}
+
+
+bool OutputFile::write(const void *data, size_t size)
+{
+  const char *pos = static_cast<const char*>(data);
+  while (size > 0) {
+    DWORD written = 0;
+    DWORD chunkSize = static_cast<DWORD>((std::min)(size, static_cast<size_t>(1 << 30)));
+    if (!::WriteFile(m_Handle, pos, chunkSize, &written, nullptr) || (written == 0)) {
+      return false;
+    }
+    pos += written;
+    size -= written;
+  }
+  return true;
+}
+
+
+bool OutputFile::close()
+{
+  bool result = true;
+  if (m_Handle != INVALID_HANDLE_VALUE) {
+    result = ::CloseHandle(m_Handle) != FALSE;
+    m_Handle = INVALID_HANDLE_VALUE;
+  }
+  return result;
+}
+
+
+#else // WIN32
+
+
+OutputFile::OutputFile()
+  : m_Fd(-1), m_Existed(false)
+{
+}
+
+
+static int openFlags(bool replace)
+{
+  return O_RDWR | O_CREAT | O_CLOEXEC | (replace ? O_TRUNC : O_EXCL);
+}
+
+
+bool OutputFile::open(const char *fileName, bool replace)
+{
+  close();
+  m_Fd = ::open(fileName, openFlags(replace), 0666);
+  m_Existed = (m_Fd < 0) && (errno == EEXIST);
+  return m_Fd >= 0;
+}
+
+
+bool OutputFile::openAt(int directory, const char *fileName, bool replace)
+{
+  close();
+  m_Fd = ::openat(directory, fileName, openFlags(replace), 0666);
+  m_Existed = (m_Fd < 0) && (errno == EEXIST);
+  return m_Fd >= 0;
+}
+
+
+bool OutputFile::isOpen() const
+{
+  return m_Fd >= 0;
+}
+
+
+bool OutputFile::write(const void *data, size_t size)
+{
+  const char *pos = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t res = ::write(m_Fd, pos, size);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    pos += res;
+    size -= static_cast<size_t>(res);
+  }
+  return true;
+}
+
+
+bool OutputFile::close()
+{
+  bool result = true;
+  if (m_Fd >= 0) {
+    result = ::close(m_Fd) == 0;
+    m_Fd = -1;
+  }
+  return result;
+}
+
+
+#endif // WIN32
+
+
+OutputFile::~OutputFile()
+{
+  close();
+}
+
+
+OutputDirectory::OutputDirectory()
+{
+}
+
+
+OutputDirectory::~OutputDirectory()
+{
+  close();
+}
+
+
+// orders paths so that every directory is directly followed by its
+// subdirectories: separators compare lower than any other character
+static bool pathLess(const std::string &lhs, const std::string &rhs)
+{
+  size_t length = (std::min)(lhs.length(), rhs.length());
+  for (size_t i = 0; i < length; ++i) {
+    char left = lhs[i] == SEPARATOR ? '\0' : lhs[i];
+    char right = rhs[i] == SEPARATOR ? '\0' : rhs[i];
+    if (left != right) {
+      return static_cast<unsigned char>(left) < static_cast<unsigned char>(right);
+    }
+  }
+  return lhs.length() < rhs.length();
+}
+
+
+#ifndef WIN32
+
+// folder descriptors are kept open up to a quarter of the descriptor limit,
+// the rest is left to the extraction and the application
+static size_t folderDescriptorLimit()
+{
+  struct rlimit limit;
+  if ((::getrlimit(RLIMIT_NOFILE, &limit) != 0) || (limit.rlim_cur == RLIM_INFINITY)) {
+    return 256;
+  }
+  return static_cast<size_t>(limit.rlim_cur / 4);
+}
+
+#endif // WIN32
+
+
+// a single folder or file name. Windows ignores trailing dots and spaces, so
+// names consisting only of those may refer to the parent folder there. Colons
+// would select a drive or an alternate data stream
+static bool validName(const char *begin, const char *end)
+{
+  if (begin == end) {
+    return false;
+  }
+#ifdef WIN32
+  bool dotsOnly = true;
+  for (const char *pos = begin; pos != end; ++pos) {
+    if (*pos == ':') {
+      return false;
+    }
+    dotsOnly = dotsOnly && ((*pos == '.') || (*pos == ' '));
+  }
+  if (dotsOnly) {
+    return false;
+  }
+#else
+  if ((end - begin <= 2) && (std::count(begin, end, '.') == end - begin)) {
+    return false;
+  }
+#endif // WIN32
+  return (std::find(begin, end, '\\') == end) && (std::find(begin, end, '/') == end);
+}
+
+
+bool OutputDirectory::validPath(const std::string &path)
+{
+  std::string::size_type begin = 0;
+  while (!path.empty()) {
+    std::string::size_type end = path.find_first_of("\\/", begin);
+    if (end == std::string::npos) {
+      end = path.length();
+    }
+    if (!validName(path.c_str() + begin, path.c_str() + end)) {
+      return false;
+    }
+    if (end == path.length()) {
+      break;
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+
+bool OutputDirectory::validFileName(const char *fileName)
+{
+  return validName(fileName, fileName + strlen(fileName));
+}
+
+
+bool OutputDirectory::valid(size_t folder, const char *fileName) const
+{
+  return m_FoldersValid[folder] && validFileName(fileName);
+}
+
+
+bool OutputDirectory::create(const std::string &targetDirectory, const std::vector<std::string> &folders)
+{
+  close();
+  m_TargetDirectory = targetDirectory;
+
+  // every path component has to be created, parents before their children.
+  // Paths from the archive are checked first, otherwise a crafted archive
+  // could create files anywhere
+  std::vector<std::string> directories;
+  m_Folders.clear();
+  m_Folders.reserve(folders.size());
+  m_FoldersValid.clear();
+  m_FoldersValid.reserve(folders.size());
+  for (std::vector<std::string>::const_iterator iter = folders.begin();
+       iter != folders.end(); ++iter) {
+    std::string path = *iter;
+    std::replace(path.begin(), path.end(), '\\', SEPARATOR);
+    std::replace(path.begin(), path.end(), '/', SEPARATOR);
+    m_Folders.push_back(path);
+    m_FoldersValid.push_back(validPath(path));
+    if (!m_FoldersValid.back()) {
+      continue;
+    }
+    std::string::size_type pos = 0;
+    while (!path.empty() && (pos != std::string::npos)) {
+      pos = path.find(SEPARATOR, pos + 1);
+      directories.push_back(path.substr(0, pos));
+    }
+  }
+  std::sort(directories.begin(), directories.end(), pathLess);
+  directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+
+#ifdef WIN32
+  ::CreateDirectoryA(targetDirectory.c_str(), nullptr);
+  for (std::vector<std::string>::const_iterator iter = directories.begin();
+       iter != directories.end(); ++iter) {
+    std::string subDirName = targetDirectory + SEPARATOR + *iter;
+    ::CreateDirectoryA(subDirName.c_str(), nullptr);
+  }
+  return true;
+#else
+  ::mkdir(targetDirectory.c_str(), 0777);
+  int targetFd = ::open(targetDirectory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (targetFd < 0) {
+    return false;
+  }
+
+  // first position of each folder in the list. Folders listed twice are
+  // opened by path the second time
+  std::map<std::string, size_t> folderPositions;
+  for (size_t i = 0; i < m_Folders.size(); ++i) {
+    if (m_FoldersValid[i]) {
+      folderPositions.insert(std::make_pair(m_Folders[i], i));
+    }
+  }
+  m_FolderFds.assign(m_Folders.size(), -1);
+  size_t descriptorsLeft = folderDescriptorLimit();
+
+  // each directory is created relative to its parent, which is still open
+  // as the sort order puts subdirectories right after their parent
+  struct OpenDirectory {
+    std::string path;
+    int fd;
+    bool kept;
+  };
+  std::vector<OpenDirectory> parents;
+  OpenDirectory target = { std::string(), targetFd, false };
+  std::map<std::string, size_t>::const_iterator position = folderPositions.find(std::string());
+  if (position != folderPositions.end()) {
+    // files directly in the target directory
+    m_FolderFds[position->second] = targetFd;
+    target.kept = true;
+  }
+  parents.push_back(target);
+
+  for (std::vector<std::string>::const_iterator iter = directories.begin();
+       iter != directories.end(); ++iter) {
+    while ((parents.size() > 1)
+           && ((iter->length() <= parents.back().path.length())
+               || (iter->compare(0, parents.back().path.length(), parents.back().path) != 0)
+               || ((*iter)[parents.back().path.length()] != SEPARATOR))) {
+      if (!parents.back().kept && (parents.back().fd >= 0)) {
+        ::close(parents.back().fd);
+      }
+      parents.pop_back();
+    }
+
+    const OpenDirectory &parent = parents.back();
+    const char *name = iter->c_str() + (parent.path.empty() ? 0 : parent.path.length() + 1);
+    OpenDirectory directory = { *iter, -1, false };
+    if (parent.fd >= 0) {
+      ::mkdirat(parent.fd, name, 0777);
+      directory.fd = ::openat(parent.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    position = folderPositions.find(*iter);
+    if ((directory.fd >= 0) && (position != folderPositions.end()) && (descriptorsLeft > 0)) {
+      m_FolderFds[position->second] = directory.fd;
+      directory.kept = true;
+      --descriptorsLeft;
+    }
+    parents.push_back(directory);
+  }
+
+  for (std::vector<OpenDirectory>::const_iterator iter = parents.begin();
+       iter != parents.end(); ++iter) {
+    if (!iter->kept && (iter->fd >= 0)) {
+      ::close(iter->fd);
+    }
+  }
+  return true;
+#endif // WIN32
+}
+
+
+void OutputDirectory::close()
+{
+#ifndef WIN32
+  for (std::vector<int>::const_iterator iter = m_FolderFds.begin();
+       iter != m_FolderFds.end(); ++iter) {
+    if (*iter >= 0) {
+      ::close(*iter);
+    }
+  }
+  m_FolderFds.clear();
+#endif // WIN32
+}
+
+
+std::string OutputDirectory::path(size_t folder, const char *fileName) const
+{
+  if (m_Folders[folder].empty()) {
+    return m_TargetDirectory + SEPARATOR + fileName;
+  } else {
+    return m_TargetDirectory + SEPARATOR + m_Folders[folder] + SEPARATOR + fileName;
+  }
+}
+
+
+#ifdef WIN32
+
+static std::string toLower(const std::string &name)
+{
+  std::string result(name);
+  for (std::string::iterator iter = result.begin(); iter != result.end(); ++iter) {
+    *iter = static_cast<char>(::tolower(static_cast<unsigned char>(*iter)));
+  }
+  return result;
+}
+
+#endif // WIN32
+
+
+void OutputDirectory::findExisting(size_t folder, const std::vector<const char*> &fileNames,
+                                   std::vector<bool> &exists) const
+{
+  exists.assign(fileNames.size(), false);
+  if (!m_FoldersValid[folder]) {
+    return;
+  }
+
+  std::vector<std::string> entries;
+#ifdef WIN32
+  std::string pattern = path(folder, "*");
+  WIN32_FIND_DATAA findData;
+  HANDLE search = ::FindFirstFileA(pattern.c_str(), &findData);
+  if (search == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  do {
+    entries.push_back(toLower(findData.cFileName));
+  } while (::FindNextFileA(search, &findData));
+  ::FindClose(search);
+#else
+  DIR *directory = nullptr;
+  if (m_FolderFds[folder] >= 0) {
+    // fdopendir takes over the descriptor, so the folder is opened again
+    int fd = ::openat(m_FolderFds[folder], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      directory = ::fdopendir(fd);
+      if (directory == nullptr) {
+        ::close(fd);
+      }
+    }
+  } else {
+    directory = ::opendir(path(folder, "").c_str());
+  }
+  if (directory == nullptr) {
+    return;
+  }
+  while (struct dirent *entry = ::readdir(directory)) {
+    entries.push_back(entry->d_name);
+  }
+  ::closedir(directory);
+#endif // WIN32
+
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < fileNames.size(); ++i) {
+    if (!validFileName(fileNames[i])) {
+      // "." and ".." are listed but they aren't files to skip
+      continue;
+    }
+#ifdef WIN32
+    exists[i] = std::binary_search(entries.begin(), entries.end(), toLower(fileNames[i]));
+#else
+    exists[i] = std::binary_search(entries.begin(), entries.end(), std::string(fileNames[i]));
+#endif // WIN32
+  }
+}
+
+
+
+
+bool OutputDirectory::open(size_t folder, const char *fileName, OutputFile &file,
+                           bool replace) const
+{
+  if (!valid(folder, fileName)) {
+    return false;
+  }
+#ifndef WIN32
+  if (m_FolderFds[folder] >= 0) {
+    return file.openAt(m_FolderFds[folder], fileName, replace);
+  }
+#endif // WIN32
+  return file.open(path(folder, fileName).c_str(), replace);
+}
+
+
+} // namespace BSA
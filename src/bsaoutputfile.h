@@ -0,0 +1,214 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef BSAOUTPUTFILE_H
+#define BSAOUTPUTFILE_H
+
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <Windows.h>
+#endif // WIN32
+
+
+namespace BSA {
+
+
+/**
+ * @brief file an extracted file is written to. Data is written without
+ * buffering, callers write in large chunks anyway
+ */
+class OutputFile {
+
+public:
+
+  OutputFile();
+  ~OutputFile();
+
+  /**
+   * create a file for writing. The file is opened for reading too so it can
+   * be memory mapped
+   * @param fileName name of the file
+   * @param replace if true an existing file is replaced, otherwise opening fails
+   * @return true on success
+   */
+  bool open(const char *fileName, bool replace = true);
+
+#ifndef WIN32
+  /**
+   * create a file relative to a directory descriptor, see open
+   * @param directory descriptor of the directory containing the file
+   * @param fileName name of the file within the directory
+   * @param replace if true an existing file is replaced, otherwise opening fails
+   */
+  bool openAt(int directory, const char *fileName, bool replace = true);
+
+  /**
+   * @return the file descriptor, -1 if the file isn't open
+   */
+  int descriptor() const { return m_Fd; }
+#else
+  HANDLE handle() const { return m_Handle; }
+#endif // WIN32
+
+  bool isOpen() const;
+
+  /**
+   * @return true if the last open failed because the file exists
+   */
+  bool existed() const { return m_Existed; }
+
+  /**
+   * write to the file at its current position
+   * @return false if not all data could be written
+   */
+  bool write(const void *data, size_t size);
+
+  /**
+   * close the file
+   * @return false if the file couldn't be closed properly
+   */
+  bool close();
+
+private:
+
+  // copy constructor not implemented
+  OutputFile(const OutputFile &reference);
+
+  // assignment operator not implemented
+  OutputFile &operator=(const OutputFile &reference);
+
+private:
+
+#ifdef WIN32
+  HANDLE m_Handle;
+#else
+  int m_Fd;
+#endif // WIN32
+  bool m_Existed;
+
+};
+
+
+/**
+ * @brief directory tree files are extracted to. All folders are created in a
+ * single pass. On POSIX systems descriptors of the folders are kept open and
+ * files are opened relative to them, so their paths don't have to be
+ * resolved again for every file
+ */
+class OutputDirectory {
+
+public:
+
+  OutputDirectory();
+  ~OutputDirectory();
+
+  /**
+   * create the directory tree below a target directory. The target
+   * directory itself is created if it doesn't exist, its parent has to.
+   * Folders whose path isn't valid (see validPath) are left out
+   * @param targetDirectory the directory to extract to
+   * @param folders paths of the folders to create relative to the target
+   *                directory, separated by '\\' or '/'. Files are opened by
+   *                the position of their folder in this list
+   * @return false if the target directory can't be opened
+   */
+  bool create(const std::string &targetDirectory, const std::vector<std::string> &folders);
+
+  /**
+   * close all folder descriptors
+   */
+  void close();
+
+  /**
+   * @return true if a file can be created in one of the folders without
+   *         leaving the target directory
+   * @param folder position of the folder in the list passed to create
+   * @param fileName name of the file within the folder
+   */
+  bool valid(size_t folder, const char *fileName) const;
+
+  /**
+   * @return true if a folder path from an archive stays below the directory
+   *         it's extracted to: it's relative and has no empty, "." or ".."
+   *         components. The empty path is the directory itself
+   */
+  static bool validPath(const std::string &path);
+
+  /**
+   * @return true if a file name from an archive names a file in the folder
+   *         it's extracted to: it's not empty, "." or ".." and contains no
+   *         separators
+   */
+  static bool validFileName(const char *fileName);
+
+  /**
+   * find out which files exist in one of the folders with a single scan of
+   * the folder. On Windows names are compared case-insensitively. Files
+   * that aren't valid are never reported as existing
+   * @param folder position of the folder in the list passed to create
+   * @param fileNames names of the files to look for
+   * @param exists receives for each file whether it exists
+   */
+  void findExisting(size_t folder, const std::vector<const char*> &fileNames,
+                    std::vector<bool> &exists) const;
+
+  /**
+   * create a file in one of the folders, see OutputFile::open
+   * @param folder position of the folder in the list passed to create
+   * @param fileName name of the file within the folder
+   * @param file the file to open
+   * @param replace if true an existing file is replaced, otherwise opening fails
+   * @return true on success. Fails for files that aren't valid
+   */
+  bool open(size_t folder, const char *fileName, OutputFile &file, bool replace) const;
+
+private:
+
+  // copy constructor not implemented
+  OutputDirectory(const OutputDirectory &reference);
+
+  // assignment operator not implemented
+  OutputDirectory &operator=(const OutputDirectory &reference);
+
+  std::string path(size_t folder, const char *fileName) const;
+
+private:
+
+  std::string m_TargetDirectory;
+  // folder paths, with the native separator
+  std::vector<std::string> m_Folders;
+  // false for folders that weren't created because their path isn't valid
+  std::vector<bool> m_FoldersValid;
+#ifndef WIN32
+  // descriptor of each folder, -1 for those opened by path
+  std::vector<int> m_FolderFds;
+#endif // WIN32
+
+};
+
+
+} // namespace BSA
+
+#endif // BSAOUTPUTFILE_H
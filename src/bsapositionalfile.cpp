@@ -0,0 +1,231 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsapositionalfile.h"
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif // WIN32
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif // __linux__
+
+
+namespace BSA {
+
+
+#ifdef WIN32
+
+
+PositionalFile::PositionalFile()
+  : m_Handle(INVALID_HANDLE_VALUE)
+{
+}
+
+
+bool PositionalFile::open(const char *fileName)
+{
+  close();
+  m_Handle = ::CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  return m_Handle != INVALID_HANDLE_VALUE;
+}
+
+
+void PositionalFile::close()
+{
+  if (m_Handle != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(m_Handle);
+    m_Handle = INVALID_HANDLE_VALUE;
+  }
+}
+
+
+bool PositionalFile::isOpen() const
+{
+  return m_Handle != INVALID_HANDLE_VALUE;
+}
+
+
+size_t PositionalFile::read(void *buffer, size_t size, unsigned long long offset) const
+{
+  // with an explicit offset in the OVERLAPPED structure ReadFile doesn't
+  // depend on the file pointer, even on a handle opened for synchronous I/O
+  size_t done = 0;
+  while (done < size) {
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = static_cast<DWORD>(offset + done);
+    overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+    DWORD read = 0;
+    if (!::ReadFile(m_Handle, static_cast<char*>(buffer) + done,
+                    static_cast<DWORD>(size - done), &read, &overlapped)
+        || (read == 0)) {
+      break;
+    }
+    done += read;
+  }
+  return done;
+}
+
+
+#else // WIN32
+
+
+PositionalFile::PositionalFile()
+  : m_Fd(-1)
+{
+}
+
+
+bool PositionalFile::open(const char *fileName)
+{
+  close();
+  m_Fd = ::open(fileName, O_RDONLY | O_CLOEXEC);
+  return m_Fd >= 0;
+}
+
+
+void PositionalFile::close()
+{
+  if (m_Fd >= 0) {
+    ::close(m_Fd);
+    m_Fd = -1;
+  }
+}
+
+
+bool PositionalFile::isOpen() const
+{
+  return m_Fd >= 0;
+}
+
+
+size_t PositionalFile::read(void *buffer, size_t size, unsigned long long offset) const
+{
+  size_t done = 0;
+  while (done < size) {
+    ssize_t res = ::pread(m_Fd, static_cast<char*>(buffer) + done, size - done,
+                          static_cast<off_t>(offset + done));
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    } else if (res == 0) {
+      break;
+    }
+    done += static_cast<size_t>(res);
+  }
+  return done;
+}
+
+
+// size of the buffer used if the kernel can't copy the data itself
+static const size_t COPY_CHUNK_SIZE = 128 * 1024;
+
+
+static bool writeAll(int fd, const char *buffer, size_t size)
+{
+  while (size > 0) {
+    ssize_t res = ::write(fd, buffer, size);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer += res;
+    size -= static_cast<size_t>(res);
+  }
+  return true;
+}
+
+
+size_t PositionalFile::copyTo(int outFd, size_t size, unsigned long long offset) const
+{
+  size_t done = 0;
+
+#ifdef __linux__
+  // copy_file_range may share extents instead of copying on file systems that
+  // support it, but depending on the kernel it doesn't work across file
+  // systems. sendfile is the fallback. Both leave the offset of m_Fd alone
+  bool copyRange = true;
+  while (done < size) {
+    ssize_t res = -1;
+    if (copyRange) {
+#ifdef __NR_copy_file_range
+      loff_t inOffset = static_cast<loff_t>(offset + done);
+      res = ::syscall(__NR_copy_file_range, m_Fd, &inOffset, outFd, nullptr, size - done, 0);
+#else
+      errno = ENOSYS;
+#endif
+    } else {
+      off_t inOffset = static_cast<off_t>(offset + done);
+      res = ::sendfile(outFd, m_Fd, &inOffset, size - done);
+    }
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (copyRange) {
+        copyRange = false;
+        continue;
+      }
+      break;
+    } else if (res == 0) {
+      break;
+    }
+    done += static_cast<size_t>(res);
+  }
+#endif // __linux__
+
+  if (done < size) {
+    std::vector<char> buffer((std::min)(size - done, COPY_CHUNK_SIZE));
+    while (done < size) {
+      size_t chunkSize = read(buffer.data(), (std::min)(size - done, buffer.size()), offset + done);
+      if ((chunkSize == 0) || !writeAll(outFd, buffer.data(), chunkSize)) {
+        break;
+      }
+      done += chunkSize;
+    }
+  }
+
+  return done;
+}
+
+
+#endif // WIN32
+
+
+PositionalFile::~PositionalFile()
+{
+  close();
+}
+
+
+} // namespace BSA
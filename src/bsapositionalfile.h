@@ -0,0 +1,107 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef BSAPOSITIONALFILE_H
+#define BSAPOSITIONALFILE_H
+
+
+#include <cstddef>
+
+#ifdef WIN32
+#include <Windows.h>
+#endif // WIN32
+
+
+namespace BSA {
+
+
+/**
+ * @brief read-only file that is always read at an explicit position. There
+ * is no file pointer shared between reads, so any number of threads can read
+ * from the same instance at once
+ */
+class PositionalFile {
+
+public:
+
+  PositionalFile();
+  ~PositionalFile();
+
+  /**
+   * open a file for reading
+   * @param fileName name of the file
+   * @return true on success
+   */
+  bool open(const char *fileName);
+
+  void close();
+
+  bool isOpen() const;
+
+  /**
+   * read from the file
+   * @param buffer receives the data
+   * @param size number of bytes to read
+   * @param offset position in the file to read from
+   * @return number of bytes read. Less than size at the end of the file or on error
+   */
+  size_t read(void *buffer, size_t size, unsigned long long offset) const;
+
+#ifndef WIN32
+  /**
+   * @return the file descriptor, -1 if the file isn't open
+   */
+  int descriptor() const { return m_Fd; }
+
+  /**
+   * copy part of the file to another file. On Linux the data is copied by the
+   * kernel (copy_file_range or sendfile) without passing through user space.
+   * If neither is supported for the two files it's read and written in chunks
+   * @param outFd descriptor of the file to write to. Written at its current position
+   * @param size number of bytes to copy
+   * @param offset position in this file to copy from
+   * @return number of bytes copied. Less than size at the end of the file or on error
+   */
+  size_t copyTo(int outFd, size_t size, unsigned long long offset) const;
+#endif // WIN32
+
+private:
+
+  // copy constructor not implemented
+  PositionalFile(const PositionalFile &reference);
+
+  // assignment operator not implemented
+  PositionalFile &operator=(const PositionalFile &reference);
+
+private:
+
+#ifdef WIN32
+  HANDLE m_Handle;
+#else
+  int m_Fd;
+#endif // WIN32
+
+};
+
+
+} // namespace BSA
+
+#endif // BSAPOSITIONALFILE_H
@@ -20,7 +20,14 @@ SOURCES += \
     bsaexception.cpp \
     bsafolder.cpp \
     bsaarchive.cpp \
-    bsatypes.cpp
+    bsatypes.cpp \
+    bsaindex.cpp \
+    bsabufferpool.cpp \
+    bsainflater.cpp \
+    bsaioring.cpp \
+    bsapositionalfile.cpp \
+    bsamappedoutput.cpp \
+    bsaoutputfile.cpp
 
 HEADERS += \
     filehash.h \
@@ -29,7 +36,14 @@ HEADERS += \
     bsafile.h \
     bsafolder.h \
     bsaexception.h \
-    bsaarchive.h
+    bsaarchive.h \
+    bsaindex.h \
+    bsabufferpool.h \
+    bsainflater.h \
+    bsaioring.h \
+    bsapositionalfile.h \
+    bsamappedoutput.h \
+    bsaoutputfile.h
 
 
 INCLUDEPATH += "$${ZLIBPATH}" "$${ZLIBPATH}/build" "$${BOOSTPATH}"
@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <fstream>
 #include <string>
+#include <cstring>
 #include "bsaexception.h"
 
 #ifdef WIN32
@@ -57,6 +58,25 @@ template <typename T> static T readType(std::fstream &file)
 }
 
 
+/**
+ * read a value from a memory buffer (i.e. a mapped archive)
+ * @param data position to read from. This is advanced past the value
+ * @param end end of the buffer
+ * @return the value read
+ * @throw data_invalid_exception if the buffer is too short
+ */
+template <typename T> static T readType(const char *&data, const char *end)
+{
+  if (static_cast<size_t>(end - data) < sizeof(T)) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  T value;
+  memcpy(&value, data, sizeof(T));
+  data += sizeof(T);
+  return value;
+}
+
+
 template <typename T> static void writeType(std::fstream &file, const T &value)
 {
   union {
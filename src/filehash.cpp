@@ -33,75 +33,136 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 
-static unsigned long genHashInt(const unsigned char *pos, const unsigned char *end)
+namespace {
+
+// lower case (ascii only, as with the "C" locale) and backslashes as separators
+inline unsigned char normalizeChar(char c)
+{
+  unsigned char result = static_cast<unsigned char>(c);
+  if (static_cast<unsigned char>(result - 'A') < 26) {
+    result += 'a' - 'A';
+  }
+  return result == '/' ? '\\' : result;
+}
+
+BSAULong genHashInt(const char *pos, const char *end)
 {
-  unsigned long hash = 0;
+  BSAULong hash = 0;
   for (; pos < end; ++pos) {
     hash *= 0x1003f;
-    hash += *pos;
+    hash += normalizeChar(*pos);
   }
   return hash;
 }
 
-/**
- * @brief calculateBSAHash
- * @param fileName
- * @return
- * @note the hash calculated for folders seem to be wrong
- */
-BSAHash calculateBSAHash(const std::string &fileName)
+// compare a normalized extension (without the dot) to a lower case string
+bool extensionIs(const char *ext, size_t extLength, const char *test)
 {
-  char fileNameLower[FILENAME_MAX + 1];
-  int i = 0;
-  for (; i < FILENAME_MAX && fileName[i] != '\0'; ++i) {
-    fileNameLower[i] = tolower(fileName[i]);
-    if (fileNameLower[i] == '/') {
-      fileNameLower[i] = '\\';
+  size_t i = 0;
+  for (; (i < extLength) && (test[i] != '\0'); ++i) {
+    if (normalizeChar(ext[i]) != static_cast<unsigned char>(test[i])) {
+      return false;
     }
   }
-  fileNameLower[i] = '\0';
+  return (i == extLength) && (test[i] == '\0');
+}
 
-  unsigned char *fileNameLowerU = reinterpret_cast<unsigned char*>(fileNameLower);
+}
 
-  size_t length = strlen(fileNameLower);
 
-  char* ext = strrchr(fileNameLower, '.');
-  if (ext == nullptr) {
-    ext = fileNameLower + length;
-  }
+BSAHash calculateBSAHash(const std::string &fileName)
+{
+  return calculateBSAHash(fileName.c_str(), fileName.length());
+}
+
 
-  size_t extLen = strlen(ext);
-  length -= extLen;
+BSAHash calculateBSAHash(const char *fileName, size_t length)
+{
+  // names used to be copied to a buffer of this size first, longer names
+  // are truncated to stay compatible
+  if (length > FILENAME_MAX) {
+    length = FILENAME_MAX;
+  }
+  const char *nameEnd = static_cast<const char*>(memchr(fileName, '\0', length));
+  if (nameEnd != nullptr) {
+    length = nameEnd - fileName;
+  }
 
-  unsigned char *extU = reinterpret_cast<unsigned char*>(ext);
+  // the extension starts at the last dot
+  size_t rootLength = length;
+  while ((rootLength > 0) && (fileName[rootLength - 1] != '.')) {
+    --rootLength;
+  }
+  rootLength = rootLength > 0 ? rootLength - 1 : length;
+  const char *ext = fileName + rootLength;
+  size_t extLen = length - rootLength;
 
   BSAHash hash1 = 0ULL;
 
-  if (length > 0) {
+  if (rootLength > 0) {
+    unsigned char last = normalizeChar(fileName[rootLength - 1]);
+    unsigned char secondLast = rootLength > 2 ? normalizeChar(fileName[rootLength - 2]) : 0;
+    unsigned char first = normalizeChar(fileName[0]);
+    // the first character is shifted as an int, values >= 0x80 set the
+    // upper 32 bits on 64 bit builds. Kept for compatibility
     hash1 = static_cast<BSAHash>(
-           fileNameLowerU[length - 1]
-         | ((length > 2 ? fileNameLowerU[length - 2] : 0) << 8)
-         | (length << 16)
-         | (fileNameLowerU[0] << 24)
+           last
+         | (secondLast << 8)
+         | (rootLength << 16)
+         | (first << 24)
         );
   }
 
   if (extLen > 0) {
-    if (strcmp(ext + 1, "kf") == 0) {
+    if (extensionIs(ext + 1, extLen - 1, "kf")) {
       hash1 |= 0x80;
-    } else if (strcmp(ext + 1, "nif") == 0) {
+    } else if (extensionIs(ext + 1, extLen - 1, "nif")) {
       hash1 |= 0x8000;
-    } else if (strcmp(ext + 1, "dds") == 0) {
+    } else if (extensionIs(ext + 1, extLen - 1, "dds")) {
       hash1 |= 0x8080;
-    } else if (strcmp(ext + 1, "wav") == 0) {
+    } else if (extensionIs(ext + 1, extLen - 1, "wav")) {
       hash1 |= 0x80000000;
     }
 
-    BSAHash hash2 = static_cast<BSAHash>(genHashInt(fileNameLowerU + 1, extU - 2))
-                  + static_cast<BSAHash>(genHashInt(extU, extU + strlen(ext)));
+    BSAULong hash2 = (rootLength > 3 ? genHashInt(fileName + 1, ext - 2) : 0)
+                   + genHashInt(ext, ext + extLen);
 
-    hash1 |= (hash2 & 0xFFFFFFFF) << 32;
+    hash1 |= static_cast<BSAHash>(hash2 & 0xFFFFFFFF) << 32;
   }
 
   return hash1;
 }
+
+
+void calculateBSAHashes(const char *const *fileNames, const size_t *lengths,
+                        size_t count, BSAHash *hashes)
+{
+  for (size_t i = 0; i < count; ++i) {
+    hashes[i] = calculateBSAHash(fileNames[i], lengths[i]);
+  }
+}
+
+
+BSAHash calculateBSAFolderHash(const std::string &folderName)
+{
+  return calculateBSAFolderHash(folderName.c_str(), folderName.length());
+}
+
+
+BSAHash calculateBSAFolderHash(const char *folderName, size_t length)
+{
+  if (length == 0) {
+    return 0ULL;
+  }
+
+  BSAHash hash1 = static_cast<BSAHash>(
+         static_cast<BSAULong>(normalizeChar(folderName[length - 1]))
+       | static_cast<BSAULong>(length > 2 ? normalizeChar(folderName[length - 2]) : 0) << 8
+       | static_cast<BSAULong>(length) << 16
+       | static_cast<BSAULong>(normalizeChar(folderName[0])) << 24);
+
+  BSAHash hash2 = length > 3 ? static_cast<BSAHash>(genHashInt(folderName + 1, folderName + length - 2))
+                             : 0ULL;
+
+  return hash1 | ((hash2 & 0xFFFFFFFF) << 32);
+}
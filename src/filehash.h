@@ -29,6 +29,35 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 BSAHash calculateBSAHash(const std::string &fileName);
 
+/**
+ * calculate the hash of a file name without copying it
+ * @param fileName the file name. Doesn't need to be zero-terminated, the
+ *                 name ends at the first zero though
+ * @param length length of the name
+ * @return the hash, same as for the std::string overload
+ */
+BSAHash calculateBSAHash(const char *fileName, size_t length);
+
+/**
+ * calculate the hashes of a list of file names
+ * @param fileNames the file names
+ * @param lengths the lengths of the file names
+ * @param count number of names
+ * @param hashes receives the hashes. Has to have room for count elements
+ */
+void calculateBSAHashes(const char *const *fileNames, const size_t *lengths,
+                        size_t count, BSAHash *hashes);
+
+/**
+ * calculate the hash of a folder path as stored in the folder records of an
+ * archive. Unlike file names, folder names are hashed without special
+ * treatment of extensions
+ * @param folderName path of the folder, i.e. "meshes\\clutter"
+ * @return the hash
+ */
+BSAHash calculateBSAFolderHash(const std::string &folderName);
+BSAHash calculateBSAFolderHash(const char *folderName, size_t length);
+
 
 #endif // FILEHASH_H
 